@@ -0,0 +1,9 @@
+#include <time.h>
+
+#include "host-clock.h"
+
+uint64_t host_clock_ns() {
+  timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,15 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Wall clock of the host. Lives in its own translation unit: <time.h> declares
+time(), which clashes with PlantMonitor time struct.
+*/
+
+#include <stdint.h>
+
+/**
+ * Get monotonic wall clock time.
+ * @return nanoseconds since an arbitrary point in the past.
+ */
+uint64_t host_clock_ns();
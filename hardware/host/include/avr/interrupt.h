@@ -0,0 +1,7 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+// Host stand-in for avr-libc header: there are no interrupts on host.
+
+#define cli()
+#define sei()
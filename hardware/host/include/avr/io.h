@@ -0,0 +1,6 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+// Host stand-in for avr-libc header: there are no I/O registers on host.
+
+#define _BV(bit) (1 << (bit))
@@ -0,0 +1,13 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+// Host stand-in for avr-libc header: there is only one address space on host.
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
@@ -0,0 +1,11 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+// Host stand-in for avr-libc header: host never sleeps waiting for interrupts.
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_cpu()
+#define sleep_disable()
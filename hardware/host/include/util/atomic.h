@@ -0,0 +1,13 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Host stand-in for avr-libc header: host code runs in a single thread without
+interrupts, so atomic blocks are just blocks.
+*/
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type)                                                     \
+  for (bool atomic_once = true; atomic_once; atomic_once = false)
@@ -0,0 +1,534 @@
+#include <stdio.h>
+
+#include "bme280.h"
+#include "ds3231.h"
+#include "events.h"
+#include "health.h"
+#include "host-clock.h"
+#include "i2c-host.h"
+#include "i2c.h"
+#include "proto.h"
+#include "sampling-policy.h"
+#include "scd40.h"
+#include "sim-devices.h"
+
+/*
+Runs PlantMonitor drivers against simulated peripherals: checks they get the
+expected values out of them, then measures how long every driver operation
+takes on host. Bus statistics show how long the same operations would keep the
+real bus busy. Returns non-zero if any check fails.
+*/
+
+#define BENCHMARK_ITERATIONS 1000
+
+static uint8_t failures = 0;
+
+static void check(const bool condition, const char *what) {
+  printf("%s: %s\n", condition ? "ok  " : "FAIL", what);
+  if (!condition)
+    ++failures;
+}
+
+template <typename Operation>
+static void benchmark(const char *name, Operation &&operation) {
+  uint64_t started = host_clock_ns();
+  for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; ++i)
+    operation();
+  uint64_t elapsed = host_clock_ns() - started;
+
+  printf("%-28s %8.1f ns\n", name,
+         static_cast<double>(elapsed) / BENCHMARK_ITERATIONS);
+}
+
+static i2c_bus_controller *bus = nullptr;
+
+static void processI2C(const event &) { bus->process_completions(); }
+
+static bool scd40_received = false;
+static scd_40::measurement_data scd40_data = {};
+
+static void scd40DataReceived(bool success,
+                              const scd_40::measurement_data &data) {
+  scd40_received = success;
+  scd40_data = data;
+}
+
+static uint16_t scd40_delay_ms = 0;
+static bool scd40_schedulable = true;
+static bool scheduleSCD40(uint16_t delay_ms) {
+  scd40_delay_ms = delay_ms;
+  return scd40_schedulable;
+}
+
+static bool scd40_sequence_done = false;
+static bool scd40_sequence_success = false;
+
+static void scd40SequenceDone(bool success) {
+  scd40_sequence_done = true;
+  scd40_sequence_success = success;
+}
+
+// Host backend completes a transaction as soon as it's submitted
+static i2c_status transfer(i2c_bus_controller &i2c, const uint8_t address,
+                           const i2c_segment *segments, const uint8_t count) {
+  i2c_transaction t;
+  t.address = address;
+  t.segments = segments;
+  t.segment_count = count;
+
+  return i2c.submit(t) ? t.status : i2c_status::invalid;
+}
+
+/**
+ * Let time pass while SCD40 driver waits for its commands to execute, and come
+ * back to it, like the timer would. Background readout is completed as well.
+ * @param now current time, milliseconds.
+ * @return time the driver is done waiting at.
+ */
+static uint32_t waitSCD40(scd_40 &scd40, scd_40_sim &sim, uint32_t now) {
+  while (scd40.busy()) {
+    now += scd40_delay_ms;
+    sim.elapse(scd40_delay_ms);
+    scd40.resume(now);
+  }
+
+  event_queue::dispatch();
+  return now;
+}
+
+/**
+ * Check SCD40 for new data and wait for the check to complete.
+ * @param[in,out] now current time, milliseconds, moved past the check.
+ * @return true if there is new data to read.
+ */
+static bool checkSCD40(scd_40 &scd40, scd_40_sim &sim, uint32_t &now) {
+  if (!scd40.check_sample(now, scd_40::sequence_callback()))
+    return false;
+
+  now = waitSCD40(scd40, sim, now);
+  return scd40.sample_ready();
+}
+
+/**
+ * Read SCD40 measurement and wait for the readout to complete, the result is
+ * left in scd40_data.
+ * @param[in,out] now current time, milliseconds, moved past the readout.
+ * @return true if the measurement has been read.
+ */
+static bool readSCD40(scd_40 &scd40, scd_40_sim &sim, uint32_t &now) {
+  scd40_received = false;
+  if (!scd40.request_data(scd_40::data_callback::create<scd40DataReceived>()))
+    return false;
+
+  now = waitSCD40(scd40, sim, now);
+  return scd40_received;
+}
+
+/**
+ * Let SCD40 sample with its own clock, and read it when the driver says so.
+ * @param period_ms actual sampling period of SCD40.
+ * @param periods amount of samples to take.
+ * @return amount of samples overwritten before they were read.
+ */
+static uint16_t runSCD40(scd_40 &scd40, scd_40_sim &sim,
+                         const uint32_t period_ms, const uint16_t periods) {
+  uint16_t lost = 0;
+  uint32_t sample_ms = period_ms;
+
+  scd40.start_measurement(0);
+  for (uint32_t now = 0; now <= periods * period_ms; now += 10) {
+    if (now >= sample_ms) {
+      if (sim.ready())
+        ++lost;
+      sim.sample();
+      sample_ms += period_ms;
+    }
+
+    if (checkSCD40(scd40, sim, now))
+      readSCD40(scd40, sim, now);
+  }
+
+  scd40.stop_measurement();
+  sim.elapse(SCD40_STOP_DELAY_MS);
+  return lost;
+}
+
+static void printStats(i2c_bus_controller &i2c) {
+  printf("\naddr transactions    bytes nacks   min   avg   max (us)\n");
+
+  i2c_device_stats stats;
+  for (uint8_t i = 0; i2c.get_stats(i, stats); ++i)
+    printf("0x%02X %12u %8u %5u %5u %5u %5u\n", stats.address,
+           stats.transactions, stats.bytes, stats.nacks, stats.min_us,
+           stats.average_us(), stats.max_us);
+}
+
+int main() {
+  // Strapped to the alternative address, the driver has to find it
+  bme_280_sim bme280_sim(0x77);
+  ds_3231_sim ds3231_sim;
+  scd_40_sim scd40_sim;
+  write_protected_sim protected_sim(0x50);
+  i2c_sim_bus::attach(bme280_sim);
+  i2c_sim_bus::attach(ds3231_sim);
+  i2c_sim_bus::attach(scd40_sim);
+  i2c_sim_bus::attach(protected_sim);
+
+  i2c_bus_controller i2c;
+  bme_280 bme280(&i2c);
+  ds_3231 ds3231(&i2c);
+  scd_40 scd40(&i2c);
+
+  bus = &i2c;
+  event_queue::set_handler(ev_i2c_complete,
+                           event_queue::handler::create<processI2C>());
+
+  // Bus scan
+  check(bme280.discover() && bme280.bus_address() == 0x77,
+        "BME280 found at 0x77");
+  check(ds3231.discover(), "DS3231 found");
+  check(scd40.discover(), "SCD40 found");
+  check(!i2c.probe(0x51), "nothing found at 0x51");
+
+  // Bus controller: DS3231 alarm register read, written and read back
+  const uint8_t alarm_reg = 0x07;
+  uint8_t alarm_before = 0xFF, alarm = 0x42, alarm_after = 0;
+  const i2c_segment batch[] = {{&alarm_reg, 1, &alarm_before, 1, true},
+                               {&alarm_reg, 1, &alarm, 1, false},
+                               {&alarm_reg, 1, &alarm_after, 1, true}};
+  i2c_device_stats stats;
+  i2c.reset_stats();
+  check(transfer(i2c, 0x68, batch, 3) == i2c_status::ok && alarm_before == 0 &&
+            alarm_after == 0x42 && i2c.get_stats(0, stats) &&
+            stats.transactions == 1 && stats.bytes == 6,
+        "read/write/read batch is a single transaction");
+  check(transfer(i2c, 0x51, batch, 1) == i2c_status::address_nack &&
+            i2c.get_stats(1, stats) && stats.address == 0x51 &&
+            stats.nacks == 1,
+        "absent peripheral NACKs its address");
+  check(transfer(i2c, 0x50, &batch[1], 1) == i2c_status::data_nack &&
+            i2c.get_stats(2, stats) && stats.nacks == 1,
+        "write protected peripheral NACKs data");
+  const i2c_segment empty_read = {&alarm_reg, 1, &alarm, 0, true};
+  check(transfer(i2c, 0x68, batch, 0) == i2c_status::invalid &&
+            transfer(i2c, 0x68, &empty_read, 1) == i2c_status::invalid,
+        "malformed transactions are rejected");
+  i2c.probe(0x62);
+  i2c.probe(0x77);
+  check(i2c.get_stats(3, stats) && stats.address == 0x62 &&
+            !i2c.get_stats(4, stats),
+        "peripherals past the statistics table go unaccounted");
+
+  // BME280
+  check(bme280.available(), "BME280 is available");
+  check(bme280.start_measurement(), "BME280 measurement started");
+  bool idle = false;
+  check(bme280.idle(idle) && idle, "BME280 is idle");
+
+  bme_280::measurement_data bme280_data = {};
+  check(bme280.get_data(bme280_data), "BME280 data read");
+  check(bme280_data.temperature == 2508, "BME280 temperature is 25.08 C");
+  check(bme280_data.pressure == 100656, "BME280 pressure is 1006.56 hPa");
+  check(bme280_data.humidity == 6610, "BME280 humidity is 66.10 %");
+  printf("      BME280: %d.%02d C, %u Pa, %u.%02u%%\n",
+         bme280_data.temperature / 100, bme280_data.temperature % 100,
+         bme280_data.pressure, bme280_data.humidity / 100,
+         bme280_data.humidity % 100);
+
+  bme_280::configuration config;
+  config.temperature = bme_280::oversampling::x2;
+  config.pressure = bme_280::oversampling::x16;
+  config.iir_filter = bme_280::filter::x4;
+  config.standby_time = bme_280::standby::ms_125;
+  config.measurement_mode = bme_280::mode::normal;
+  check(bme280.configure(config) && bme280_sim.register_value(0xF2) == 0x01 &&
+            bme280_sim.register_value(0xF4) == 0x57 &&
+            bme280_sim.register_value(0xF5) == 0x48,
+        "BME280 configured to normal mode");
+
+  uint32_t measurements = bme280_sim.measurements;
+  check(bme280.start_measurement() && bme280.idle(idle) && idle &&
+            bme280.get_data(bme280_data) &&
+            bme280_sim.measurements == measurements + 1 &&
+            bme280_data.temperature == 2508,
+        "BME280 normal mode takes a single read");
+
+  // DS3231
+  const time set = {24, 10, 17, 4, 12, 34, 56};
+  time got = {};
+  check(ds3231.available(), "DS3231 is available");
+  check(ds3231.set_time(set), "DS3231 time set");
+  check(ds3231.get_time(got), "DS3231 time read");
+  check(got.year == set.year && got.month == set.month &&
+            got.dayOfMonth == set.dayOfMonth && got.hours == set.hours &&
+            got.minutes == set.minutes && got.seconds == set.seconds,
+        "DS3231 time is the one set");
+
+  uint16_t ds3231_temperature = 0;
+  check(ds3231.get_temperature(ds3231_temperature) &&
+            ds3231_temperature == 2525,
+        "DS3231 temperature is 25.25 C");
+
+  // SCD40, time in milliseconds
+  const uint8_t status_command[] = {0xE4, 0xB8};
+  uint8_t status[3] = {};
+  const i2c_segment command_and_read = {status_command, 2, status, 3, true};
+  const i2c_segment response = {nullptr, 0, status, 3, true};
+  check(transfer(i2c, 0x62, &command_and_read, 1) ==
+                i2c_status::address_nack &&
+            scd40_sim.rejected() == 1,
+        "SCD40 NACKs a read before the command is executed");
+  scd40_sim.elapse(SCD40_COMMAND_DELAY_MS);
+  check(transfer(i2c, 0x62, &response, 1) == i2c_status::ok &&
+            status[0] == 0x80,
+        "SCD40 response is read once the command is executed");
+
+  const scd_40::sequence_callback sequence_done =
+      scd_40::sequence_callback::create<scd40SequenceDone>();
+  scd40.set_scheduler(scd_40::scheduler::create<scheduleSCD40>());
+  check(scd40.available(sequence_done) && scd40.busy() &&
+            scd40_delay_ms == SCD40_COMMAND_DELAY_MS,
+        "SCD40 availability check waits for the command to execute");
+  uint32_t now = waitSCD40(scd40, scd40_sim, 0);
+  check(scd40_sequence_done && scd40_sequence_success, "SCD40 is available");
+
+  check(scd40.start_measurement(now) && scd40_sim.measuring(),
+        "SCD40 measurement started");
+  scd40.set_compensation_pressure(1006);
+  check(scd40_sim.compensation_pressure() == 1013,
+        "SCD40 compensation pressure waits for the next check");
+  now = scd40.next_check_ms();
+  scd40_sim.sample();
+  check(checkSCD40(scd40, scd40_sim, now) &&
+            scd40_sim.compensation_pressure() == 1006,
+        "SCD40 compensation pressure is sent along with the check");
+  check(readSCD40(scd40, scd40_sim, now) && scd40_data.co2ppm == 500,
+        "SCD40 CO2 is 500 ppm");
+  check(scd40_data.temperature == 2500 && scd40_data.humidity == 3700,
+        "SCD40 temperature is 25.00 C, humidity is 37.00 %");
+  printf("      SCD40: %u ppm, %d.%02d C, %u.%02u %%\n", scd40_data.co2ppm,
+         scd40_data.temperature / 100, scd40_data.temperature % 100,
+         scd40_data.humidity / 100, scd40_data.humidity % 100);
+
+  // SCD40 readout schedule, time in milliseconds since the measurement start
+  scd40.stop_measurement();
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.reset_schedule_stats();
+  check(scd40.start_measurement(0) &&
+            scd40.next_check_ms() == 5000 + SCD40_READOUT_MARGIN_MS,
+        "SCD40 first check is due one period after the start");
+  now = 1000;
+  check(!checkSCD40(scd40, scd40_sim, now) &&
+            scd40.get_schedule_stats().checks == 0,
+        "SCD40 isn't asked before the sample is due");
+  now = scd40.next_check_ms();
+  uint32_t checked = now;
+  check(!checkSCD40(scd40, scd40_sim, now) &&
+            scd40.next_check_ms() == checked + SCD40_POLL_MS,
+        "SCD40 late sample is polled for");
+  now = checked = scd40.next_check_ms();
+  scd40_sim.sample();
+  check(checkSCD40(scd40, scd40_sim, now) &&
+            scd40.next_check_ms() == checked + 5000,
+        "SCD40 schedule is aligned to the late sample");
+  readSCD40(scd40, scd40_sim, now);
+  now = checked = scd40.next_check_ms();
+  scd40_sim.sample();
+  check(checkSCD40(scd40, scd40_sim, now) &&
+            scd40.next_check_ms() == checked + 5000,
+        "SCD40 sample on time keeps the schedule");
+  const scd_40::schedule_stats &schedule = scd40.get_schedule_stats();
+  check(schedule.checks == 3 && schedule.early_checks == 1 &&
+            schedule.samples == 2,
+        "SCD40 schedule stats");
+
+  // 200 samples with SCD40 clock on time, 2 % fast and 2 % slow
+  readSCD40(scd40, scd40_sim, now);
+  scd40.stop_measurement();
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.reset_schedule_stats();
+  check(runSCD40(scd40, scd40_sim, 5000, 200) == 0 &&
+            schedule.checks <= 200 + 2 * 200 / SCD40_PROBE_PERIODS,
+        "SCD40 on time is checked once a sample, early now and then");
+  check(runSCD40(scd40, scd40_sim, 4900, 200) == 0,
+        "SCD40 clock running fast loses no samples");
+  check(runSCD40(scd40, scd40_sim, 5100, 200) == 0,
+        "SCD40 clock running slow loses no samples");
+
+  // SCD40 command sequences, time in milliseconds
+  scd40_sequence_done = false;
+  scd40.set_scheduler(scd_40::scheduler());
+  check(!scd40.initialize(false, 0, sequence_done) && !scd40.busy() &&
+            !scd40_sequence_done,
+        "SCD40 sequence fails without a scheduler to wait with");
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.set_scheduler(scd_40::scheduler::create<scheduleSCD40>());
+  check(scd40.initialize(false, 0, sequence_done) && scd40.busy() &&
+            !scd40_sim.measuring() && scd40_delay_ms == SCD40_STOP_DELAY_MS,
+        "SCD40 initialization waits for the stop");
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.resume(SCD40_STOP_DELAY_MS);
+  check(scd40.busy() && scd40.serial_number() == 0 &&
+            scd40_delay_ms == SCD40_COMMAND_DELAY_MS,
+        "SCD40 serial number waits for its command to execute");
+  now = SCD40_STOP_DELAY_MS + SCD40_COMMAND_DELAY_MS;
+  scd40_sim.elapse(SCD40_COMMAND_DELAY_MS);
+  scd40.resume(now);
+  check(scd40.serial_number() == 0xF8969F073BB0,
+        "SCD40 serial number is read once stopped");
+  check(!scd40.busy() && scd40_sequence_done && scd40_sequence_success &&
+            scd40.measuring() && !scd40.low_power() && scd40_sim.measuring() &&
+            scd40.next_check_ms() == now + 5000 + SCD40_READOUT_MARGIN_MS,
+        "SCD40 initialization starts measurement");
+
+  scd40_sequence_done = false;
+  check(scd40.restart(true, 1000, sequence_done) && scd40.busy() &&
+            !scd40.measuring() && !scd40.restart(false, 1000, sequence_done),
+        "SCD40 restart waits for the stop, one sequence at a time");
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.resume(1000 + SCD40_STOP_DELAY_MS);
+  check(scd40_sequence_done && scd40_sequence_success && scd40.low_power(),
+        "SCD40 restarted in low power mode");
+
+  scd40_sequence_done = false;
+  check(scd40.initialize(false, 2000, sequence_done), "SCD40 initialization");
+  scd40_sim.set_online(false);
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.resume(2000 + SCD40_STOP_DELAY_MS);
+  check(scd40.busy() && scd40.serial_number() == 0,
+        "SCD40 serial number isn't there, not fatal");
+  scd40.resume(2000 + SCD40_STOP_DELAY_MS + SCD40_COMMAND_DELAY_MS);
+  check(!scd40.busy() && scd40_sequence_done && !scd40_sequence_success &&
+            !scd40.measuring(),
+        "SCD40 gone in the middle of initialization fails it");
+  check(!scd40.restart(false, 3000, sequence_done) && !scd40.busy(),
+        "SCD40 gone before a sequence fails it right away");
+  scd40_sim.set_online(true);
+
+  scd40_sequence_done = false;
+  check(scd40.initialize(false, 4000, sequence_done), "SCD40 initialization");
+  scd40_schedulable = false;
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40.resume(4000 + SCD40_STOP_DELAY_MS);
+  check(!scd40.busy() && scd40_sequence_done && !scd40_sequence_success,
+        "SCD40 sequence fails if it can't be scheduled");
+  scd40_sim.elapse(SCD40_COMMAND_DELAY_MS);
+  check(!scd40.restart(false, 5000, sequence_done) && !scd40.busy(),
+        "SCD40 sequence that can't be scheduled fails right away");
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  scd40_schedulable = true;
+  check(scd40_sim.rejected() == 1,
+        "SCD40 is never addressed before its command is executed");
+
+  // Missing peripheral
+  bme280_sim.set_online(false);
+  check(!bme280.available(), "offline BME280 is not available");
+  bme280_sim.set_online(true);
+  check(bme280.initialize() && bme280.get_data(bme280_data) &&
+            bme280_data.temperature == 2508,
+        "BME280 is back after re-initialization");
+
+  // Cached calibration is only used if it's the one of this BME280
+  bme_280_calibration cached = *bme280.calibration();
+  i2c.reset_stats();
+  check(bme280.initialize(&cached) && i2c.get_stats(0, stats) &&
+            stats.bytes < 20,
+        "BME280 cached calibration is revalidated with a short read");
+  cached.T1 += 1;
+  check(bme280.initialize(&cached) && bme280.calibration()->T1 == 27504 &&
+            bme280.get_data(bme280_data) && bme280_data.temperature == 2508,
+        "BME280 foreign cached calibration is read again");
+
+  // Health tracking: offline after 3 failures, reprobed after 2, 4, 8 s...
+  device_health health;
+  health.report(false, 0);
+  check(health.state() == health_state::degraded && health.due(0),
+        "one failure degrades");
+  health.report(false, 0);
+  health.report(false, 1000);
+  check(health.state() == health_state::offline && !health.due(2999) &&
+            health.due(3000),
+        "three failures take offline, reprobe in 2 s");
+  health.report(false, 3000);
+  check(!health.due(6999) && health.due(7000),
+        "failed reprobe doubles backoff");
+  health.report(true, 7000);
+  check(health.state() == health_state::online, "successful reprobe is online");
+
+  // SCD40 measurement mode policy, time in milliseconds since start
+  sampling_policy policy;
+  check(policy.mode(0) == sampling_mode::periodic &&
+            policy.mode(SAMPLING_HOLD_MS) == sampling_mode::low_power,
+        "full rate after start, low power once it's over");
+  uint32_t at = SAMPLING_HOLD_MS;
+  policy.sample(500, at);
+  policy.sample(502, at += SAMPLING_RATE_WINDOW_MS);
+  check(policy.mode(at) == sampling_mode::low_power,
+        "slow CO2 change keeps low power");
+  policy.sample(520, at += SAMPLING_RATE_WINDOW_MS);
+  check(policy.mode(at) == sampling_mode::periodic &&
+            policy.mode(at + SAMPLING_HOLD_MS - 1) == sampling_mode::periodic &&
+            policy.mode(at + SAMPLING_HOLD_MS) == sampling_mode::low_power,
+        "fast CO2 change switches to full rate for a while");
+  at += SAMPLING_HOLD_MS;
+  policy.subscribe(60, at);
+  check(policy.mode(at + 59999) == sampling_mode::periodic &&
+            policy.mode(at + 60000) == sampling_mode::low_power,
+        "host subscription keeps full rate");
+  policy.subscribe(60, at);
+  policy.subscribe(0, at);
+  check(policy.mode(at) == sampling_mode::low_power,
+        "host subscription is cancelled");
+
+  scd40.stop_measurement();
+  scd40_sim.elapse(SCD40_STOP_DELAY_MS);
+  check(scd40.start_low_power_measurement(0) && scd40.low_power() &&
+            scd40.next_check_ms() == 30000 + SCD40_READOUT_MARGIN_MS,
+        "SCD40 low power measurement is checked every 30 s");
+
+  // Serial protocol: oversized request with requests inside, then a real one
+  uint8_t stream[PMC_MIN_MSG_LENGTH + PMC_MAX_PAYLOAD_SIZE + 4 +
+                 PMC_MAX_MSG_LENGTH] = {
+      0x3A, pmcSubscribe, PMC_MAX_PAYLOAD_SIZE + 4};
+  uint8_t size = 3;
+  while (size < 3 + PMC_MAX_PAYLOAD_SIZE + 4) {
+    const uint8_t measurement[] = {0x3A, 0x01, 0x00, 0x70};
+    for (uint8_t byte : measurement)
+      stream[size++] = byte;
+  }
+  stream[size++] = 0; // CRC of the oversized request, never checked
+
+  plantMessage *request = pmCreate();
+  pmFillSubscription(60, request);
+  uint8_t request_size = sizeof(stream) - size;
+  pmSerialize(request, stream + size, &request_size);
+  size += request_size;
+
+  pmParser parser;
+  pmParserReset(&parser);
+  uint8_t oversized = 0, parsed = 0;
+  uint16_t seconds = 0;
+  for (uint8_t i = 0; i < size; ++i) {
+    pmParseResult result = pmParserFeed(&parser, stream[i], request);
+    if (result == prOversized)
+      ++oversized;
+    else if (result == prOk && ++parsed &&
+             pmGetMessageCode(request) == pmcSubscribe)
+      pmGetSubscription(request, &seconds);
+  }
+  pmDestroy(request);
+  check(oversized == 1 && parsed == 1 && seconds == 60,
+        "oversized request is skipped as a whole");
+
+  i2c.reset_stats();
+
+  printf("\nhost time per operation, %u iterations:\n", BENCHMARK_ITERATIONS);
+  benchmark("bme_280::start_measurement", [&] { bme280.start_measurement(); });
+  benchmark("bme_280::get_data", [&] { bme280.get_data(bme280_data); });
+  benchmark("ds_3231::get_time", [&] { ds3231.get_time(got); });
+  benchmark("scd_40::request_data", [&] { readSCD40(scd40, scd40_sim, now); });
+
+  printStats(i2c);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+#include "sim-devices.h"
+
+// Bus addresses, see the drivers
+#define DS3231_SIM_ADDRESS (uint8_t)0x68
+#define SCD40_SIM_ADDRESS (uint8_t)0x62
+
+// Same as SCD40 uses: polynomial 0x31, initial value 0xFF
+static uint8_t crc8(const uint8_t *data, uint8_t count) {
+  uint8_t crc = 0xFF;
+
+  while (count--) {
+    crc ^= *(data++);
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+  }
+
+  return crc;
+}
+
+bme_280_sim::bme_280_sim(const uint8_t address)
+    : i2c_sim_register_device(address) {
+  // T1...P9, little endian words starting from 0x88
+  static const int32_t t_p_calibration[] = {27504, 26435,  -1000, 36477,
+                                            -10685, 3024,   2855,  140,
+                                            -7,     15500, -14600, 6000};
+
+  uint8_t reg = 0x88;
+  for (int32_t word : t_p_calibration) {
+    m_registers[reg++] = word & 0xFF;
+    m_registers[reg++] = word >> 8;
+  }
+
+  // H1 at 0xA1, then H2...H6 packed into 0xE1...0xE7
+  const int16_t H2 = 362, H4 = 313, H5 = 50;
+  m_registers[0xA1] = 75;
+  m_registers[0xE1] = H2 & 0xFF;
+  m_registers[0xE2] = H2 >> 8;
+  m_registers[0xE3] = 0;
+  m_registers[0xE4] = H4 >> 4;
+  m_registers[0xE5] = (H4 & 0x0F) | ((H5 & 0x0F) << 4);
+  m_registers[0xE6] = H5 >> 4;
+  m_registers[0xE7] = 30;
+
+  m_registers[0xD0] = 0x60; // chip ID
+}
+
+bool bme_280_sim::start(const bool read) {
+  if (read && (m_registers[0xF4] & 0x03) == 0x03)
+    measure();
+
+  return i2c_sim_register_device::start(read);
+}
+
+void bme_280_sim::written(const uint8_t reg) {
+  // ctrl_meas: any mode but sleep starts a measurement, forced one goes back
+  // to sleep right after
+  if (reg != 0xF4 || !(m_registers[0xF4] & 0x03))
+    return;
+
+  if ((m_registers[0xF4] & 0x03) != 0x03)
+    m_registers[0xF4] &= ~0x03;
+
+  measure();
+}
+
+void bme_280_sim::measure() {
+  // 20-bit pressure and temperature are left aligned, humidity is 16-bit
+  const uint32_t adc[] = {static_cast<uint32_t>(adc_P) << 4,
+                          static_cast<uint32_t>(adc_T) << 4};
+  uint8_t data = 0xF7;
+  for (uint32_t value : adc) {
+    m_registers[data++] = value >> 16;
+    m_registers[data++] = value >> 8;
+    m_registers[data++] = value;
+  }
+  m_registers[data++] = adc_H >> 8;
+  m_registers[data++] = adc_H;
+
+  ++measurements;
+}
+
+ds_3231_sim::ds_3231_sim() : i2c_sim_register_device(DS3231_SIM_ADDRESS) {
+  m_registers[0x11] = 25;   // temperature, integer part
+  m_registers[0x12] = 0x40; // 0.25 DegC
+}
+
+bool write_protected_sim::start(const bool /*read*/) {
+  m_register_selected = false;
+  return true;
+}
+
+bool write_protected_sim::write(const uint8_t /*byte*/) {
+  if (m_register_selected)
+    return false;
+
+  m_register_selected = true;
+  return true;
+}
+
+scd_40_sim::scd_40_sim() : i2c_sim_device(SCD40_SIM_ADDRESS) {}
+
+void scd_40_sim::elapse(const uint16_t ms) {
+  m_busy_ms = ms < m_busy_ms ? m_busy_ms - ms : 0;
+}
+
+bool scd_40_sim::start(const bool read) {
+  if (m_busy_ms) {
+    ++m_rejected;
+    return false;
+  }
+
+  if (read)
+    m_response_index = 0;
+  else
+    m_received_count = 0;
+
+  return true;
+}
+
+bool scd_40_sim::write(const uint8_t byte) {
+  if (m_received_count == sizeof(m_received))
+    return false;
+
+  m_received[m_received_count++] = byte;
+
+  // Command is executed once it's complete, along with its argument if any
+  if (m_received_count == 2 || m_received_count == sizeof(m_received))
+    execute();
+
+  return true;
+}
+
+uint8_t scd_40_sim::read() {
+  return m_response_index < m_response_size ? m_response[m_response_index++]
+                                            : 0xFF;
+}
+
+void scd_40_sim::execute() {
+  // Commands are big endian on the bus
+  const uint16_t command = (m_received[0] << 8) | m_received[1];
+
+  if (m_received_count == 2)
+    m_response_size = 0;
+
+  // Execution time of everything but the start of periodic measurement
+  m_busy_ms = 1;
+
+  switch (command) {
+  case 0x21B1: // start_periodic_measurement
+  case 0x21AC: // start_low_power_periodic_measurement
+    m_measuring = true;
+    m_busy_ms = 0;
+    break;
+  case 0x3F86: // stop_periodic_measurement
+    m_measuring = false;
+    m_ready = false;
+    m_busy_ms = 500;
+    break;
+  case 0xE4B8: { // get_data_ready_status
+    const uint16_t status = m_ready ? 0x8006 : 0x8000;
+    respond(&status, 1);
+    break;
+  }
+  case 0xEC05: { // read_measurement
+    static const uint16_t measurement[] = {0x01F4, 0x6667, 0x5EB9};
+    respond(measurement, 3);
+    m_ready = false;
+    break;
+  }
+  case 0xE000: // get_ambient_pressure, set_ambient_pressure with argument
+    if (m_received_count == 2)
+      respond(&m_pressure, 1);
+    else if (!crc8(m_received + 2, 3))
+      m_pressure = (m_received[2] << 8) | m_received[3];
+    break;
+  case 0x3682: { // get_serial_number, not available while measuring
+    static const uint16_t serial_number[] = {0xF896, 0x9F07, 0x3BB0};
+    if (!m_measuring)
+      respond(serial_number, 3);
+    break;
+  }
+  }
+}
+
+void scd_40_sim::respond(const uint16_t *words, const uint8_t count) {
+  uint8_t *iterator = m_response;
+
+  for (uint8_t i = 0; i < count; ++i) {
+    iterator[0] = words[i] >> 8;
+    iterator[1] = words[i] & 0xFF;
+    iterator[2] = crc8(iterator, 2);
+    iterator += 3;
+  }
+
+  m_response_size = iterator - m_response;
+}
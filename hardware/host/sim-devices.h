@@ -0,0 +1,103 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Simulated peripherals of PlantMonitor, just enough of them to run the drivers
+on a Linux host. Measurements are instant and always the same.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "i2c-host.h"
+
+/*
+BME280 with calibration and raw ADC values taken from the compensation example
+of BMP280 datasheet, section 3.12: 25.08 DegC and 1006.56 hPa. Humidity part is
+made up, but still sensible. Address is 0x76 unless strapped to 0x77. In
+normal mode a new measurement is ready whenever it's read.
+*/
+class bme_280_sim : public i2c_sim_register_device {
+public:
+  bme_280_sim(const uint8_t address = 0x76);
+
+  // Raw ADC values published on the next forced or normal mode measurement.
+  int32_t adc_T = 519888;
+  int32_t adc_P = 415148;
+  int32_t adc_H = 32000;
+
+  // Amount of measurements performed.
+  uint32_t measurements = 0;
+
+  bool start(const bool read) override;
+
+protected:
+  void written(const uint8_t reg) override;
+
+private:
+  void measure();
+};
+
+// DS3231 keeping the time it's been set to, 25.25 DegC.
+class ds_3231_sim : public i2c_sim_register_device {
+public:
+  ds_3231_sim();
+};
+
+/*
+Peripheral which acknowledges its address and a register address, but not the
+data, like a write-protected memory which NACKs the data bytes.
+*/
+class write_protected_sim : public i2c_sim_device {
+public:
+  using i2c_sim_device::i2c_sim_device;
+
+  bool start(const bool read) override;
+  bool write(const uint8_t byte) override;
+  uint8_t read() override { return 0xFF; }
+
+private:
+  bool m_register_selected = false;
+};
+
+/*
+SCD40 speaking its 16-bit command protocol. Measurement is always 500 ppm,
+25 DegC, 37% (datasheet, section 3.6.2); it's reported ready once sample() is
+called during periodic measurement, and until it's read. Commands take their
+execution time from the datasheet: until elapse() lets it pass, the address is
+NACKed, as SCD40 does.
+*/
+class scd_40_sim : public i2c_sim_device {
+public:
+  scd_40_sim();
+
+  bool measuring() const { return m_measuring; }
+  // New measurement is ready, as if sampling period has passed
+  void sample() { m_ready = m_measuring; }
+  // Measurement is yet to be read, the next sample() would overwrite it
+  bool ready() const { return m_ready; }
+  uint16_t compensation_pressure() const { return m_pressure; }
+  // Let time pass for the command being executed
+  void elapse(const uint16_t ms);
+  // Transfers NACKed because they came before the command was executed
+  uint16_t rejected() const { return m_rejected; }
+
+  bool start(const bool read) override;
+  bool write(const uint8_t byte) override;
+  uint8_t read() override;
+
+private:
+  void execute();
+  void respond(const uint16_t *words, const uint8_t count);
+
+  uint8_t m_received[5] = {}; // command and at most one argument word with CRC
+  uint8_t m_received_count = 0;
+  uint8_t m_response[9] = {};
+  uint8_t m_response_size = 0;
+  uint8_t m_response_index = 0;
+  bool m_measuring = false;
+  bool m_ready = false;
+  uint16_t m_pressure = 1013;
+  uint16_t m_busy_ms = 0;
+  uint16_t m_rejected = 0;
+};
@@ -0,0 +1,311 @@
+#include "benchmark.h"
+
+#ifndef PLANT_MONITOR_BENCHMARK
+void pmRunBenchmarks() {}
+#else
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#include "bme280-compensation.h"
+#include "convert_util.h"
+#include "crc8.h"
+#include "fixed-point.h"
+#include "proto.h"
+#include "usart.h"
+
+#define __PLANT_MESSAGE_STRUCT
+#include "plant_message_struct.h"
+
+/*
+Timer 1 is always running once timer_manager is created, its prescaler is set
+in timers.cpp: TCNT1 is incremented once every 64 CPU cycles.
+*/
+#define BENCHMARK_CYCLES_PER_TICK 64
+
+/*
+Amount of runs to average over. TCNT1 overflows every 4194304 cycles, which
+limits a single run to 16384 cycles.
+*/
+#define BENCHMARK_ITERATIONS 256
+
+/**
+ * Measure average amount of CPU cycles spent by a single call of @p f.
+ * Interrupts are disabled while measuring to keep the results stable.
+ * @param f function to measure
+ * @return cycles per call, rounded down
+ */
+template <typename F> static uint32_t measure(F &&f) {
+  uint16_t ticks = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint16_t start = TCNT1;
+    for (uint16_t i = 0; i < BENCHMARK_ITERATIONS; ++i)
+      f();
+    ticks = TCNT1 - start;
+  }
+
+  return static_cast<uint32_t>(ticks) * BENCHMARK_CYCLES_PER_TICK /
+         BENCHMARK_ITERATIONS;
+}
+
+static void report(const char *name, uint32_t cycles) {
+  pmUSARTLogText(plError, name);
+  pmUSARTLogText(plError, ": ");
+  pmUSARTLogNumber(plError, cycles);
+  pmUSARTLogText(plError, " cycles\r\n");
+
+  // Results must not be dropped, let the log queue drain between them.
+  pmUSARTLogFlush();
+}
+
+/*
+Reference implementation of the plantMessage payload handling as it was before
+the payload became inline: every size change goes through the heap.
+*/
+struct heapPlantMessage {
+  plantMessageCode code;
+  uint8_t payloadSize;
+  uint8_t *payload;
+};
+
+static void heapAdjustPayloadSize(heapPlantMessage *msg, uint8_t size) {
+  if (msg->payload) {
+    if (size == 0) {
+      free(msg->payload);
+      msg->payload = NULL;
+    } else if (msg->payloadSize != size) {
+      msg->payload = static_cast<uint8_t *>(realloc(msg->payload, size));
+    }
+  } else if (size) {
+    msg->payload = static_cast<uint8_t *>(malloc(size));
+  }
+  msg->payloadSize = size;
+}
+
+// A typical reply sequence: RTC time, then an error, then an ADC result.
+static void benchmarkMessageFill() {
+  static const time t = {24, 1, 1, 1, 12, 0, 0};
+
+  heapPlantMessage heapMsg = {};
+  report("pmFill* heap payload", measure([&heapMsg]() {
+           heapAdjustPayloadSize(&heapMsg, sizeof(time));
+           heapMsg.code = pmcRTCTime;
+           memcpy(heapMsg.payload, &t, sizeof(time));
+           heapAdjustPayloadSize(&heapMsg, 0);
+           heapMsg.code = pmcBadRequest;
+           heapAdjustPayloadSize(&heapMsg, 1);
+           heapMsg.code = pmcMeasurementResult;
+           heapMsg.payload[0] = 0xA0;
+         }));
+  heapAdjustPayloadSize(&heapMsg, 0);
+
+  plantMessage *msg = pmCreate();
+  if (!msg)
+    return;
+
+  report("pmFill* inline payload", measure([msg]() {
+           pmFillTime(&t, msg);
+           pmFillBadRequest(msg);
+           pmFillADCResult(0xA0, msg);
+         }));
+
+  pmDestroy(msg);
+}
+
+// Decimal formatting of a typical value as done for the log.
+static void benchmarkNumberFormat() {
+  static volatile int32_t number = -123456;
+  char buffer[FORMAT_DECIMAL_MAX_LENGTH + 1];
+
+  report("snprintf %ld", measure([&buffer]() {
+           snprintf(buffer, sizeof(buffer), "%ld", number);
+         }));
+
+  report("format_decimal", measure([&buffer]() {
+           char *iterator = buffer;
+           format_decimal(number, [&iterator](char c) { *(iterator++) = c; });
+           *iterator = '\0';
+         }));
+
+  report("format_decimal 1/100", measure([&buffer]() {
+           char *iterator = buffer;
+           format_decimal(
+               number, [&iterator](char c) { *(iterator++) = c; }, 2);
+           *iterator = '\0';
+         }));
+}
+
+/*
+Reference implementation of BME280 compensation as it was before temperature
+dependent terms were cached: the datasheet formulas, as is.
+*/
+static int32_t referenceTemperature(const bme_280_calibration &c,
+                                    int32_t &fineT, const int32_t adc_T) {
+  int32_t var1 = (((adc_T >> 3) - ((int32_t)c.T1 << 1)) * (int32_t)c.T2) >> 11;
+  int32_t var2 =
+      (((((adc_T >> 4) - (int32_t)c.T1) * ((adc_T >> 4) - (int32_t)c.T1)) >>
+        12) *
+       (int32_t)c.T3) >>
+      14;
+  fineT = var1 + var2;
+  return (fineT * 5 + 128) >> 8;
+}
+
+static uint32_t referencePressure(const bme_280_calibration &c,
+                                  const int32_t fineT, const int32_t adc_P) {
+  int32_t var1 = (fineT >> 1) - (int32_t)64000;
+  int32_t var2 = (((var1 >> 2) * (var1 >> 2)) >> 11) * ((int32_t)c.P6);
+  var2 = var2 + ((var1 * ((int32_t)c.P5)) << 1);
+  var2 = (var2 >> 2) + (((int32_t)c.P4) << 16);
+  var1 = (((c.P3 * (((var1 >> 2) * (var1 >> 2)) >> 13)) >> 3) +
+          ((((int32_t)c.P2) * var1) >> 1)) >>
+         18;
+  var1 = ((((32768 + var1)) * ((int32_t)c.P1)) >> 15);
+  if (var1 == 0)
+    return 0;
+
+  uint32_t p = (((uint32_t)(((int32_t)1048576) - adc_P) - (var2 >> 12))) * 3125;
+  if (p < 0x80000000)
+    p = (p << 1) / ((uint32_t)var1);
+  else
+    p = (p / (uint32_t)var1) * 2;
+
+  var1 = (((int32_t)c.P9) * ((int32_t)(((p >> 3) * (p >> 3)) >> 13))) >> 12;
+  var2 = (((int32_t)(p >> 2)) * ((int32_t)c.P8)) >> 13;
+  return (uint32_t)((int32_t)p + ((var1 + var2 + c.P7) >> 4));
+}
+
+static uint32_t referenceHumidity(const bme_280_calibration &c,
+                                  const int32_t fineT, const int32_t adc_H) {
+  int32_t v = (fineT - ((int32_t)76800));
+  v = (((((adc_H << 14) - (((int32_t)c.H4) << 20) - (((int32_t)c.H5) * v)) +
+         ((int32_t)16384)) >>
+        15) *
+       (((((((v * ((int32_t)c.H6)) >> 10) *
+            (((v * ((int32_t)c.H3)) >> 11) + ((int32_t)32768))) >>
+           10) +
+          ((int32_t)2097152)) *
+             ((int32_t)c.H2) +
+         8192) >>
+        14));
+  v = (v - (((((v >> 15) * (v >> 15)) >> 7) * ((int32_t)c.H1)) >> 4));
+  v = (v < 0 ? 0 : v);
+  v = (v > 419430400 ? 419430400 : v);
+  return (uint32_t)(v >> 12);
+}
+
+// Results go there, so they aren't optimized away
+static volatile uint32_t sink = 0;
+
+/*
+A full sample: temperature, pressure and humidity. Temperature is either the
+same for every sample, as it mostly is for a plant monitor, or alternates to
+defeat the cache of temperature dependent terms.
+*/
+static void benchmarkCompensation() {
+  static const bme_280_calibration calibration = {
+      27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7,
+      15500, -14600, 6000, 75, 362, 0, 313, 50, 30};
+  static volatile int32_t adc_T = 519888;
+  static volatile int32_t adc_P = 415148;
+  static volatile int32_t adc_H = 32000;
+
+  int32_t fineT = 0;
+  report("BME280 reference", measure([&fineT]() {
+           sink = referenceTemperature(calibration, fineT, adc_T);
+           sink = referencePressure(calibration, fineT, adc_P);
+           sink = referenceHumidity(calibration, fineT, adc_H);
+         }));
+
+  bme_280_compensation compensation(calibration);
+  report("BME280 same temperature", measure([&compensation]() {
+           sink = compensation.temperature(adc_T);
+           sink = compensation.pressure(adc_P);
+           sink = compensation.humidity(adc_H);
+         }));
+
+  int32_t delta = 16;
+  report("BME280 new temperature", measure([&compensation, &delta]() {
+           delta = -delta;
+           sink = compensation.temperature(adc_T + delta);
+           sink = compensation.pressure(adc_P);
+           sink = compensation.humidity(adc_H);
+         }));
+}
+
+/*
+SCD40 temperature and humidity conversion, as it was done with float division
+before fixed-point.h. Note that referencing it links soft-float library into
+the benchmark build.
+*/
+static void benchmarkSCD40Conversion() {
+  static volatile uint16_t temperature = 0x6667;
+  static volatile uint16_t humidity = 0x5EB9;
+
+  report("SCD40 float", measure([]() {
+           sink = static_cast<int16_t>(-4500 + (temperature / 3.74f));
+           sink = static_cast<uint8_t>(humidity / 655.35f);
+         }));
+
+  report("SCD40 fixed point", measure([]() {
+           sink = -4500 + static_cast<int16_t>(q_scale<17500, 16>(temperature));
+           sink = q_scale<10000, 16>(humidity);
+         }));
+}
+
+/*
+Reference implementation of SCD40 CRC as it was before crc8.h: bit by bit, like
+crc8_sensirion::update_bitwise(), but without the compiler knowing the
+polynomial at the point of use.
+*/
+static uint8_t referenceSCD40CRC(uint8_t crc, uint8_t byte) {
+  crc ^= byte;
+
+  for (uint8_t crc_bit = 8; crc_bit > 0; --crc_bit) {
+    if (crc & 0x80)
+      crc = (crc << 1) ^ 0x31;
+    else
+      crc = (crc << 1);
+  }
+
+  return crc;
+}
+
+// CRC8 of a single byte, every variant of both polynomials in use.
+static void benchmarkCRC8() {
+  static volatile uint8_t byte = 0xA5;
+  static volatile uint8_t crc = 0x3C;
+
+  report("CRC8 Maxim avr-libc",
+         measure([]() { sink = _crc_ibutton_update(crc, byte); }));
+  report("CRC8 Maxim bitwise",
+         measure([]() { sink = crc8_maxim::update_bitwise(crc, byte); }));
+  report("CRC8 Maxim nibble",
+         measure([]() { sink = crc8_maxim::update_nibble(crc, byte); }));
+  report("CRC8 Maxim table",
+         measure([]() { sink = crc8_maxim::update_table(crc, byte); }));
+
+  report("CRC8 Sensirion reference",
+         measure([]() { sink = referenceSCD40CRC(crc, byte); }));
+  report("CRC8 Sensirion bitwise",
+         measure([]() { sink = crc8_sensirion::update_bitwise(crc, byte); }));
+  report("CRC8 Sensirion nibble",
+         measure([]() { sink = crc8_sensirion::update_nibble(crc, byte); }));
+  report("CRC8 Sensirion table",
+         measure([]() { sink = crc8_sensirion::update_table(crc, byte); }));
+}
+
+void pmRunBenchmarks() {
+  benchmarkMessageFill();
+  benchmarkNumberFormat();
+  benchmarkCompensation();
+  benchmarkSCD40Conversion();
+  benchmarkCRC8();
+}
+
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Startup benchmarks. Built only when PLANT_MONITOR_BENCHMARK is defined (see
+PLANT_MONITOR_BENCHMARK option in the top-level CMakeLists.txt), results are
+printed over serial as "<name>: <cycles> cycles" lines right after start.
+*/
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Run every benchmark and print the results to the log, waiting for each
+ * result to be sent.
+ * Does nothing unless PLANT_MONITOR_BENCHMARK is defined.
+ */
+void pmRunBenchmarks();
+
+#if defined(__cplusplus)
+}
+#endif
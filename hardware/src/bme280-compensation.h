@@ -0,0 +1,165 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+BME280 compensation formulas, turning raw ADC values into meaningful ones. Kept
+apart from the driver, so they can be verified at compile time and benchmarked.
+
+Refer to BME280 datasheet:
+https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bme280-ds002.pdf
+*/
+
+#include <stdint.h>
+
+/*
+Calibration data, unit 4.2.2, Table 16. T1...P9 are laid out exactly as
+registers 0x88...0x9F are, little endian 16-bit words.
+*/
+struct bme_280_calibration {
+  uint16_t T1;
+  int16_t T2;
+  int16_t T3;
+  uint16_t P1;
+  int16_t P2;
+  int16_t P3;
+  int16_t P4;
+  int16_t P5;
+  int16_t P6;
+  int16_t P7;
+  int16_t P8;
+  int16_t P9;
+  uint8_t H1;
+  int16_t H2;
+  uint8_t H3;
+  int16_t H4;
+  int16_t H5;
+  int8_t H6;
+};
+
+/*
+32-bit integer compensation formulas from unit 8.2 of the datasheet, as
+AtMega328p is an 8-bit MCU without a dedicated Floating Point Unit (FPU); the
+results are bit exact.
+
+Every 32-bit multiplication is a library call on AVR, and there are plenty of
+them: yet most of them only depend on calibration and fine temperature. Those
+are calculated once per temperature and reused by pressure and humidity, for as
+long as temperature stays the same; which is often the case for consecutive
+samples of a plant monitor.
+
+Shifts of negative values to the left are undefined before C++20, and so aren't
+allowed in constant expressions: multiplications by powers of 2 are used
+instead, compiler turns them into shifts anyway.
+*/
+class bme_280_compensation {
+public:
+  constexpr bme_280_compensation() = default;
+  constexpr explicit bme_280_compensation(const bme_280_calibration &c)
+      : m_calibration(c) {}
+
+  const bme_280_calibration &calibration() const { return m_calibration; }
+
+  /**
+   * Calculate temperature from raw ADC value. Must be called before pressure()
+   * and humidity(), both depend on temperature.
+   * @param adc_T raw 20 bit ADC value from 0xFA...0xFC registers
+   * @return temperature in DegC, resolution is 0.01 DegC. Output value of
+   * "5123" equals 51.23 DegC.
+   */
+  constexpr int32_t temperature(const int32_t adc_T) {
+    const bme_280_calibration &c = m_calibration;
+
+    /*
+    Take a look at var1. If you squint your eyes really hard, you could see the
+    following expression:
+    var1 = ( (adc_T / 8 - T1 / 2) * T2) / 2048 )
+    */
+    int32_t var1 = (((adc_T >> 3) - (int32_t)c.T1 * 2) * (int32_t)c.T2) >> 11;
+
+    int32_t delta = (adc_T >> 4) - (int32_t)c.T1;
+    int32_t var2 = (((delta * delta) >> 12) * (int32_t)c.T3) >> 14;
+
+    update_fine_temperature(var1 + var2);
+    return (m_fineT * 5 + 128) >> 8;
+  }
+
+  /**
+   * Calculate pressure from raw ADC value.
+   * @param adc_P raw 20 bit ADC value from 0xF7...0xF9 registers
+   * @return pressure in Pa. Output value of "96386" equals 963.86 hPa
+   */
+  constexpr uint32_t pressure(const int32_t adc_P) const {
+    const bme_280_calibration &c = m_calibration;
+
+    // avoid exception caused by division by zero
+    if (m_pressure_divisor == 0)
+      return 0;
+
+    uint32_t p = ((uint32_t)(1048576 - adc_P) - m_pressure_offset) * 3125;
+    if (p < 0x80000000)
+      p = (p * 2) / m_pressure_divisor;
+    else
+      p = (p / m_pressure_divisor) * 2;
+
+    int32_t var1 =
+        ((int32_t)c.P9 * (int32_t)(((p >> 3) * (p >> 3)) >> 13)) >> 12;
+    int32_t var2 = ((int32_t)(p >> 2) * (int32_t)c.P8) >> 13;
+    return (uint32_t)((int32_t)p + ((var1 + var2 + c.P7) >> 4));
+  }
+
+  /**
+   * Calculate humidity from raw ADC value.
+   * @param adc_H raw 16 bit ADC value from 0xFD...0xFE registers
+   * @return humidity in %RH in Q22.10 format (22 integer and 10 fractional
+   * bits). Output value of "47445" represents 47445/1024 = 46.333 %RH
+   */
+  constexpr uint32_t humidity(const int32_t adc_H) const {
+    int32_t h = ((adc_H * 16384 - m_humidity_offset) >> 15) * m_humidity_scale;
+
+    h -= (((((h >> 15) * (h >> 15)) >> 7) * (int32_t)m_calibration.H1) >> 4);
+    h = (h < 0 ? 0 : h);
+    h = (h > 419430400 ? 419430400 : h);
+    return (uint32_t)(h >> 12);
+  }
+
+private:
+  // Recalculate terms depending on fine temperature, unless it's the same.
+  constexpr void update_fine_temperature(const int32_t fineT) {
+    if (m_fineT_valid && fineT == m_fineT)
+      return;
+
+    const bme_280_calibration &c = m_calibration;
+    m_fineT = fineT;
+    m_fineT_valid = true;
+
+    // Pressure: everything but adc_P and final correction
+    int32_t var1 = (fineT >> 1) - 64000;
+    int32_t square = (var1 >> 2) * (var1 >> 2);
+    int32_t var2 = (square >> 11) * (int32_t)c.P6;
+    var2 = var2 + var1 * (int32_t)c.P5 * 2;
+    var2 = (var2 >> 2) + (int32_t)c.P4 * 65536;
+    var1 = ((((int32_t)c.P3 * (square >> 13)) >> 3) +
+            (((int32_t)c.P2 * var1) >> 1)) >>
+           18;
+    m_pressure_divisor = (uint32_t)(((32768 + var1) * (int32_t)c.P1) >> 15);
+    m_pressure_offset = (uint32_t)(var2 >> 12);
+
+    // Humidity: everything but adc_H and final correction
+    int32_t x = fineT - 76800;
+    m_humidity_offset = (int32_t)c.H4 * 1048576 + (int32_t)c.H5 * x - 16384;
+    int32_t h6 = (x * (int32_t)c.H6) >> 10;
+    int32_t h3 = ((x * (int32_t)c.H3) >> 11) + 32768;
+    m_humidity_scale =
+        ((((h6 * h3) >> 10) + 2097152) * (int32_t)c.H2 + 8192) >> 14;
+  }
+
+  bme_280_calibration m_calibration = {};
+
+  // Fine temperature and the terms depending on it
+  int32_t m_fineT = 0;
+  bool m_fineT_valid = false;
+  uint32_t m_pressure_divisor = 0;
+  uint32_t m_pressure_offset = 0;
+  int32_t m_humidity_offset = 0;
+  int32_t m_humidity_scale = 0;
+};
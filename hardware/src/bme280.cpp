@@ -1,5 +1,6 @@
-#include <etl/vector.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bme280.h"
 #include "convert_util.h"
@@ -24,25 +25,30 @@ This device does not use SPI to access BME280, for this reason we do not care
 about SPI settings
 SPI 3 wire       [spi3w_en = 0bX]
 
-Combining this into configuration register map and register description in
-sections 5.3 and 5.4, we get following settings values:
-0xF2 ctrl_hum  [reserved: bits 7-3][osrs_h: bits 2-0] = 0b00000001
-0xF4 ctrl_meas [osrs_t: bits 7-5][osrs_p: bits 4-2][mode: bits 1 and 0] =
-0b00100101(0x25) 0xF5 config    [t_sb: bits 7-5][filter: bits 4-2][reserved: 1
-bit][spi3w_en] = 0b00000000
-
-Сonsequently, it is required to write registers 0xF2 and 0xF4, register 0xF5 is
-initialized to 0 by default after power on. HOWEVER, forced mode will
-self-reset to [mode = 0b00] after single measurement, so it must be rewritten
-every time we want to make a measurement. Moreover, for extra power savings
-this device can shut off its power entirely, therefore, all settings could be
-lost and must be re-applied before every measurement.
+Those are the defaults of bme_280::configuration, any other combination can be
+configured at runtime. Configuration register map and register description in
+sections 5.3 and 5.4 lay the settings out as following:
+0xF2 ctrl_hum  [reserved: bits 7-3][osrs_h: bits 2-0]
+0xF4 ctrl_meas [osrs_t: bits 7-5][osrs_p: bits 4-2][mode: bits 1 and 0]
+0xF5 config    [t_sb: bits 7-5][filter: bits 4-2][reserved: 1 bit][spi3w_en]
+
+Forced mode will self-reset to [mode = 0b00] after single measurement, so
+ctrl_meas must be rewritten every time we want to make a measurement. Normal
+mode keeps measuring on its own, standby time apart: output registers only have
+to be read. Moreover, for extra power savings this device can shut off its
+power entirely, therefore, all settings could be lost and must be re-applied,
+see bme_280::initialize().
 */
-#define BME280_CTRL_HUM_VALUE (uint8_t)0x01
-#define BME280_CTRL_MEAS_VALUE (uint8_t)0x25
 #define BME280_CTRL_HUM_REGISTER (uint8_t)0xF2
 #define BME280_STATUS_REGISTER (uint8_t)0xF3
 #define BME280_CTRL_MEAS_REGISTER (uint8_t)0xF4
+#define BME280_CONFIG_REGISTER (uint8_t)0xF5
+
+// Oversampling settings are 3 bits wide, see table 20 and section 5.4.5
+#define BME280_OSRS_T_SHIFT 5
+#define BME280_OSRS_P_SHIFT 2
+#define BME280_T_SB_SHIFT 5
+#define BME280_FILTER_SHIFT 2
 
 /*
 Status register contains two bits indicating status: 0 and 3. The rest is
@@ -52,10 +58,9 @@ reserved and isn't a valid data, mask it.
 
 /*
 Section 5.4.1 of the datasheet claims that reading chip ID register should
-always return 0x60.
+always return 0x60, see bme_280::chip_id.
 */
 #define BME280_CHIP_ID_REGISTER (uint8_t)0xD0
-#define BME280_CHIP_ID (uint8_t)0x60
 
 /*
 Section 6.2 mentions the two possible I2C addresses, 0x76 if SDO pin is
@@ -63,6 +68,7 @@ connected to GND and 0x77, if SDO pin is connected to Vcc. Vcc pin is
 connnected to GND on my BME280 breakout board.
 */
 #define BME280_I2C_ADDRESS (uint8_t)0x76
+#define BME280_I2C_ALTERNATIVE_ADDRESS (uint8_t)0x77
 
 /*
 Registers containing raw ADC values for various parameters. Values make no sense
@@ -75,37 +81,9 @@ without proper conversion.
 As mentioned in unit 4.2 of the datasheed, measured data is just a set of ADC
 values, those aren't useful on it's own. To convert those raw values to a
 meaningful values, we'll the code suggested by the Bosch at the unit 8.2 of
-the datasheet. In order to use this formulas, it is required to read a lot of
-calibration data. This structure is presented in unit 4.2.2, Table 16.
+the datasheet, see bme280-compensation.h. In order to use this formulas, it is
+required to read a lot of calibration data, spread over these registers.
 */
-struct bme_280::calibration_data {
-  int32_t fineT = 0;
-  uint16_t T1 = 0;
-  int16_t T2 = 0;
-  int16_t T3 = 0;
-  uint16_t P1 = 0;
-  int16_t P2 = 0;
-  int16_t P3 = 0;
-  int16_t P4 = 0;
-  int16_t P5 = 0;
-  int16_t P6 = 0;
-  int16_t P7 = 0;
-  int16_t P8 = 0;
-  int16_t P9 = 0;
-  uint8_t H1 = 0;
-  int16_t H2 = 0;
-  uint8_t H3 = 0;
-  int16_t H4 = 0;
-  int16_t H5 = 0;
-  int8_t H6 = 0;
-  bool initialized = false;
-
-  calibration_data() = default;
-  int32_t compensate_temperature(const int32_t &adc_T);
-  uint32_t compensate_pressure(const int32_t &adc_P);
-  uint32_t compensate_humidity(const int32_t &adc_H);
-};
-
 #define BME280_FIRST_T_P_CALIBRATION_REGISTER (uint8_t)0x88
 #define BME280_T_P_CALIBRATION_REGISTERS_SIZE (uint8_t)24
 
@@ -115,203 +93,209 @@ struct bme_280::calibration_data {
 #define BME280_H2_H6_CALIBRATION_REGISTERS_SIZE (uint8_t)7
 
 /*
-A little reworked compensation formulas from unit 8.2 and 4.2.3 of the
-datasheet; using alternative formulas, as AtMega328p is an 8-bit MCU without a
-dedicated Floating Point Unit (FPU).
-
-Don't blame or ask me, I have roughly zero clue how exactly this works.
+Golden vectors for the compensation formulas. The first one is the compensation
+example from section 3.12 of BMP280 datasheet (BME280 shares temperature and
+pressure formulas with it), the rest are results of Bosch reference
+implementation of the formulas, humidity included. Vectors are verified one
+after another, so cached temperature dependent terms are checked as well.
 */
+static constexpr bme_280_calibration golden_calibration = {
+    27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7,
+    15500, -14600, 6000, 75, 362, 0, 313, 50, 30};
+
+struct golden_vector {
+  int32_t adc_T, adc_P, adc_H;
+  int32_t temperature;
+  uint32_t pressure, humidity;
+};
 
-/**
- * Calculate temperature from raw ADC value
- * @param adc_T raw 20 bit ADC value from 0xFA...0xFC registers
- * @param d struct with calibration data
- * @return temperature in DegC, resolution is 0.01 DegC. Output value of "5123"
- * equals 51.23 DegC. d->fineT carries fine temperature for other compensation
- * formulas.
- */
-int32_t
-bme_280::calibration_data::compensate_temperature(const int32_t &adc_T) {
-  int32_t var1, var2, T;
-  /*
-  It looks terrifying, but bitshift operators are used as makeshift multiply or
-  divide operators by the powers of 2; i.e. x << 1 == x * 2; y >> 2 == y / 4.
-  Giving the fact that dividing 32 bit integers on an 8 bit CPU is fairly
-  expensive, this will work faster.
-
-  Take a look at var1. If you squint your eyes really hard, you could see the
-  following expression:
-  var1 = ( (adc_T / 8 - T1 / 2) * T2) / 2048 )
-
-  However, it's still uncertain what exactly it does, please ask
-  Bosch Sensortec about the details.
-  */
-  var1 = (((adc_T >> 3) - ((int32_t)T1 << 1)) * (int32_t)T2) >> 11;
-
-  // clang-format is definitely not happy with this expression :D
-  var2 =
-      (((((adc_T >> 4) - (int32_t)T1) * ((adc_T >> 4) - (int32_t)T1)) >> 12) *
-       (int32_t)T3) >>
-      14;
-
-  fineT = var1 + var2;
-  T = (fineT * 5 + 128) >> 8;
-  return T;
-}
-
-/**
- * Calculate pressure from raw ADC value
- * @param adc_P raw 20 bit ADC value from 0xF7...0xF9 registers
- * @param d struct with calibration data
- * @return pressure in Pa as unsigned 32 bit integer. Output value of "96386"
- * equals 96386 Pa = 963.86 hPa
- */
-uint32_t bme_280::calibration_data::compensate_pressure(const int32_t &adc_P) {
-  int32_t var1, var2;
-  uint32_t p;
-  var1 = (((int32_t)fineT) >> 1) - (int32_t)64000;
-  var2 = (((var1 >> 2) * (var1 >> 2)) >> 11) * ((int32_t)P6);
-  var2 = var2 + ((var1 * ((int32_t)P5)) << 1);
-  var2 = (var2 >> 2) + (((int32_t)P4) << 16);
-  var1 = (((P3 * (((var1 >> 2) * (var1 >> 2)) >> 13)) >> 3) +
-          ((((int32_t)P2) * var1) >> 1)) >>
-         18;
-  var1 = ((((32768 + var1)) * ((int32_t)P1)) >> 15);
-  if (var1 == 0) {
-    return 0;
-  } // avoid exception caused by division by zero
-  p = (((uint32_t)(((int32_t)1048576) - adc_P) - (var2 >> 12))) * 3125;
-  if (p < 0x80000000) {
-    p = (p << 1) / ((uint32_t)var1);
-  } else {
-    p = (p / (uint32_t)var1) * 2;
+static constexpr golden_vector golden_vectors[] = {
+    {519888, 415148, 32000, 2508, 100656, 67689},
+    {519888, 415148, 20000, 2508, 100656, 0},
+    {400000, 300000, 45000, -1264, 113636, 102400},
+    {600000, 500000, 28000, 5011, 89316, 45054},
+    {450000, 350000, 0, 313, 108162, 0},
+    {550000, 450000, 65535, 3451, 96007, 102400},
+    {519888, 415148, 32000, 2508, 100656, 67689}};
+
+static constexpr bool compensation_matches_golden_vectors() {
+  bme_280_compensation compensation(golden_calibration);
+
+  for (const golden_vector &v : golden_vectors) {
+    if (compensation.temperature(v.adc_T) != v.temperature ||
+        compensation.pressure(v.adc_P) != v.pressure ||
+        compensation.humidity(v.adc_H) != v.humidity)
+      return false;
   }
-  var1 = (((int32_t)P9) * ((int32_t)(((p >> 3) * (p >> 3)) >> 13))) >> 12;
-  var2 = (((int32_t)(p >> 2)) * ((int32_t)P8)) >> 13;
-  p = (uint32_t)((int32_t)p + ((var1 + var2 + P7) >> 4));
-  return p;
-}
 
-/**
- * Calculate humidity from raw ADC value
- * @param adc_H raw 16 bit ADC value from 0xFD...0xFE registers
- * @param d struct with calibration data
- * @return humidity in %RH as unsigned 32 bit integer in Q22.10 format
- * (22 integer and 10 fractional bits).
- * Output value of "47445" represents 47445/1024 = 46.333 %RH
- */
-uint32_t bme_280::calibration_data::compensate_humidity(const int32_t &adc_H) {
-  int32_t v_x1_u32r;
-  v_x1_u32r = (fineT - ((int32_t)76800));
-  v_x1_u32r =
-      (((((adc_H << 14) - (((int32_t)H4) << 20) - (((int32_t)H5) * v_x1_u32r)) +
-         ((int32_t)16384)) >>
-        15) *
-       (((((((v_x1_u32r * ((int32_t)H6)) >> 10) *
-            (((v_x1_u32r * ((int32_t)H3)) >> 11) + ((int32_t)32768))) >>
-           10) +
-          ((int32_t)2097152)) *
-             ((int32_t)H2) +
-         8192) >>
-        14));
-  v_x1_u32r =
-      (v_x1_u32r -
-       (((((v_x1_u32r >> 15) * (v_x1_u32r >> 15)) >> 7) * ((int32_t)H1)) >> 4));
-  v_x1_u32r = (v_x1_u32r < 0 ? 0 : v_x1_u32r);
-  v_x1_u32r = (v_x1_u32r > 419430400 ? 419430400 : v_x1_u32r);
-  return (uint32_t)(v_x1_u32r >> 12);
+  return true;
 }
 
+static_assert(compensation_matches_golden_vectors(),
+              "BME280 compensation doesn't match Bosch reference");
+
 bme_280::bme_280(i2c_bus_controller *controller)
+    : bme_280(controller, configuration()) {}
+
+bme_280::bme_280(i2c_bus_controller *controller, const configuration &config)
     : i2c_peripheral(BME280_I2C_ADDRESS, controller),
-      m_calibration_data(new bme_280::calibration_data) {}
+      m_configuration(config) {}
 
 bool bme_280::available() {
-  alloc_bytevect(chipID, 1);
-  if (!read(BME280_CHIP_ID_REGISTER, chipID))
+  uint8_t id = 0;
+  if (read<BME280_CHIP_ID_REGISTER>(id) != i2c_status::ok)
     return false;
 
-  return chipID[0] == BME280_CHIP_ID;
+  return id == chip_id;
 }
 
-bool bme_280::start_measurement() {
-  const bytevect<1> hum_reg_value = {BME280_CTRL_HUM_VALUE};
-  const bytevect<1> meas_reg_val = {BME280_CTRL_MEAS_VALUE};
-
-  if (!write(BME280_CTRL_HUM_REGISTER, hum_reg_value))
-    return false;
+bool bme_280::discover() {
+  static const uint8_t addresses[] = {BME280_I2C_ADDRESS,
+                                      BME280_I2C_ALTERNATIVE_ADDRESS};
 
-  if (!write(BME280_CTRL_MEAS_REGISTER, meas_reg_val))
-    return false;
+  // Reading Chip ID probes the address and tells BME280 from anything else
+  for (uint8_t address : addresses) {
+    set_bus_address(address);
+    if (available())
+      return true;
+  }
 
-  return true;
+  set_bus_address(BME280_I2C_ADDRESS);
+  return false;
 }
 
-bool bme_280::idle() {
-  bytevect<1> status = {0xFF};
-  if (!read(BME280_STATUS_REGISTER, status))
+bool bme_280::initialize(const bme_280_calibration *cached) {
+  m_calibrated = false;
+
+  if (!(cached && restore_calibration(*cached)) && !get_calibration_data())
     return false;
 
-  return !(status[0] & BME280_STATUS_REGISTER_MASK);
+  return configure(m_configuration);
 }
 
-bool bme_280::get_calibration_data() {
-  alloc_bytevect(data_buffer, BME280_T_P_CALIBRATION_REGISTERS_SIZE);
+uint8_t bme_280::ctrl_meas_value() const {
+  return static_cast<uint8_t>(m_configuration.temperature)
+             << BME280_OSRS_T_SHIFT |
+         static_cast<uint8_t>(m_configuration.pressure) << BME280_OSRS_P_SHIFT |
+         static_cast<uint8_t>(m_configuration.measurement_mode);
+}
 
-  if (!read(BME280_FIRST_T_P_CALIBRATION_REGISTER, data_buffer))
+bool bme_280::configure(const configuration &config) {
+  m_configuration = config;
+
+  if (config.temperature == oversampling::skipped)
     return false;
 
-  uint8_t *iterator = data_buffer.begin();
+  const uint8_t sleep = 0;
+  const uint8_t hum = static_cast<uint8_t>(config.humidity);
+  const uint8_t cfg =
+      static_cast<uint8_t>(config.standby_time) << BME280_T_SB_SHIFT |
+      static_cast<uint8_t>(config.iir_filter) << BME280_FILTER_SHIFT;
+  const uint8_t meas = ctrl_meas_value();
+
+  /*
+  Writes to config register may be ignored in normal mode (section 5.4.6), go to
+  sleep first. ctrl_hum is only applied after ctrl_meas is written, so ctrl_meas
+  with the actual mode goes last.
+  */
+  const i2c_segment segments[] = {
+      write_segment<BME280_CTRL_MEAS_REGISTER>(sleep),
+      write_segment<BME280_CTRL_HUM_REGISTER>(hum),
+      write_segment<BME280_CONFIG_REGISTER>(cfg),
+      write_segment<BME280_CTRL_MEAS_REGISTER>(meas)};
+
+  return transfer(segments) == i2c_status::ok;
+}
+
+bool bme_280::start_measurement() {
+  if (m_configuration.measurement_mode == mode::normal)
+    return true;
 
-  get_le(m_calibration_data->T1, iterator);
-  get_le(m_calibration_data->T2, iterator);
-  get_le(m_calibration_data->T3, iterator);
+  // ctrl_hum and config are retained, only the mode has to be set again
+  return write<BME280_CTRL_MEAS_REGISTER>(ctrl_meas_value()) == i2c_status::ok;
+}
 
-  get_le(m_calibration_data->P1, iterator);
-  get_le(m_calibration_data->P2, iterator);
-  get_le(m_calibration_data->P3, iterator);
-  get_le(m_calibration_data->P4, iterator);
-  get_le(m_calibration_data->P5, iterator);
-  get_le(m_calibration_data->P6, iterator);
-  get_le(m_calibration_data->P7, iterator);
-  get_le(m_calibration_data->P8, iterator);
-  get_le(m_calibration_data->P9, iterator);
+bool bme_280::idle(bool &result) {
+  if (m_configuration.measurement_mode == mode::normal) {
+    result = true;
+    return true;
+  }
 
-  data_buffer.resize(1);
-  if (!read(BME280_H1_CALIBRATION_REGISTER, data_buffer))
+  uint8_t status = 0xFF;
+  if (read<BME280_STATUS_REGISTER>(status) != i2c_status::ok)
     return false;
 
-  iterator = data_buffer.begin();
-  get_le(m_calibration_data->H1, iterator);
+  result = !(status & BME280_STATUS_REGISTER_MASK);
+  return true;
+}
 
-  data_buffer.resize(BME280_H2_H6_CALIBRATION_REGISTERS_SIZE);
-  if (!read(BME280_FIRST_H2_H6_CALIBRATION_REGISTER, data_buffer))
+bool bme_280::get_calibration_data() {
+  /*
+  T1...P9 registers hold little endian 16-bit words, just like AVR does: read
+  them straight into calibration data.
+  */
+  static_assert(offsetof(bme_280_calibration, P9) + sizeof(int16_t) -
+                        offsetof(bme_280_calibration, T1) ==
+                    BME280_T_P_CALIBRATION_REGISTERS_SIZE,
+                "T1...P9 must be laid out as BME280 registers are");
+
+  bme_280_calibration calibration = {};
+  uint8_t data_buffer[BME280_H2_H6_CALIBRATION_REGISTERS_SIZE];
+
+  // Calibration data is spread over three register blocks, read them at once
+  const i2c_segment segments[] = {
+      read_segment<BME280_FIRST_T_P_CALIBRATION_REGISTER>(
+          reinterpret_cast<uint8_t *>(&calibration.T1),
+          BME280_T_P_CALIBRATION_REGISTERS_SIZE),
+      read_segment<BME280_H1_CALIBRATION_REGISTER>(calibration.H1),
+      read_segment<BME280_FIRST_H2_H6_CALIBRATION_REGISTER>(data_buffer)};
+
+  if (transfer(segments) != i2c_status::ok)
     return false;
 
-  iterator = data_buffer.begin();
-  get_le(m_calibration_data->H2, iterator);
-  get_le(m_calibration_data->H3, iterator);
+  uint8_t *iterator = data_buffer;
+  get_le(calibration.H2, iterator);
+  get_le(calibration.H3, iterator);
 
   // Special case: register 0xE5 contains two nibbles of different values.
-  m_calibration_data->H4 = *(iterator++) << 4;
-  m_calibration_data->H4 |= (*(iterator)&0xF);
+  calibration.H4 = *(iterator++) << 4;
+  calibration.H4 |= (*(iterator)&0xF);
 
-  m_calibration_data->H5 = (*(iterator + 1)) << 4;
-  m_calibration_data->H5 |= (*(iterator)) >> 4;
+  calibration.H5 = (*(iterator + 1)) << 4;
+  calibration.H5 |= (*(iterator)) >> 4;
   iterator += 2;
 
-  get_le(m_calibration_data->H6, iterator);
+  get_le(calibration.H6, iterator);
 
-  m_calibration_data->initialized = true;
+  m_compensation = bme_280_compensation(calibration);
+  m_calibrated = true;
+
+  return true;
+}
+
+bool bme_280::restore_calibration(const bme_280_calibration &cached) {
+  /*
+  Calibration is trimmed for every single BME280 at the factory, so the first
+  calibration words tell whether the cached calibration belongs to this one.
+  */
+  uint8_t t_calibration[3 * sizeof(int16_t)];
+  if (read<BME280_FIRST_T_P_CALIBRATION_REGISTER>(t_calibration) !=
+      i2c_status::ok)
+    return false;
+
+  if (memcmp(t_calibration, &cached.T1, sizeof(t_calibration)))
+    return false;
+
+  m_compensation = bme_280_compensation(cached);
+  m_calibrated = true;
 
   return true;
 }
 
 bool bme_280::get_data(bme_280::measurement_data &data) {
-  etl::vector<uint8_t, BME280_DATA_REGISTERS> data_buffer(
-      BME280_DATA_REGISTERS);
+  uint8_t data_buffer[BME280_DATA_REGISTERS];
 
-  if (!read(BME280_FIRST_DATA_REGISTER, data_buffer))
+  if (read<BME280_FIRST_DATA_REGISTER>(data_buffer) != i2c_status::ok)
     return false;
 
   int32_t pressure = 0;
@@ -343,14 +327,21 @@ bool bme_280::get_data(bme_280::measurement_data &data) {
   // Raw values we're just obtained require some post-processing.
 
   // Calibration values are constant, we only need to read them once.
-  if (!m_calibration_data->initialized) {
+  if (!m_calibrated) {
     if (!get_calibration_data())
       return false;
   }
 
-  data.temperature = m_calibration_data->compensate_temperature(temperature);
-  data.pressure = m_calibration_data->compensate_pressure(pressure) / 10;
-  data.humidity = m_calibration_data->compensate_humidity(humidity) / 1024;
+  data.temperature = m_compensation.temperature(temperature);
+  data.pressure = 0;
+  data.humidity = 0;
+
+  if (m_configuration.pressure != oversampling::skipped)
+    data.pressure = m_compensation.pressure(pressure);
+
+  // Q22.10 to hundredths of percent, rounded
+  if (m_configuration.humidity != oversampling::skipped)
+    data.humidity = (m_compensation.humidity(humidity) * 100 + 512) >> 10;
 
   return true;
 }
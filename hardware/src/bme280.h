@@ -6,31 +6,122 @@ BME280 Combined humidity and pressure sensor driver, uses PlantMonitor I2C
 abstraction layer.
 */
 
-#include <etl/memory.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "bme280-compensation.h"
 #include "i2c.h"
 
 class bme_280 : protected i2c_peripheral {
   // The secret sauce. Contains boring values for processing raw measurements.
-  struct calibration_data;
-  etl::unique_ptr<calibration_data> m_calibration_data;
+  bme_280_compensation m_compensation;
+  bool m_calibrated = false;
   bool get_calibration_data();
+  bool restore_calibration(const bme_280_calibration &cached);
 
 public:
+  // Chip ID register value, see section 5.4.1 of the datasheet
+  static constexpr uint8_t chip_id = 0x60;
+
   struct measurement_data {
-    // pressure, daPa
-    uint16_t pressure;
-    // temperature / 100
+    // pressure, Pa
+    uint32_t pressure;
+    // temperature / 100, C. I.e. 2346 = 23.46 C
     int16_t temperature;
-    // relative humidity, %
-    uint8_t humidity;
+    // relative humidity / 100, %. I.e. 4633 = 46.33 %
+    uint16_t humidity;
+  };
+
+  // Values are the ones written to the registers, see datasheet section 5.4.
+  enum class oversampling : uint8_t { skipped, x1, x2, x4, x8, x16 };
+
+  // IIR filter coefficient
+  enum class filter : uint8_t { off, x2, x4, x8, x16 };
+
+  // Time between measurements in normal mode
+  enum class standby : uint8_t {
+    ms_0_5,
+    ms_62_5,
+    ms_125,
+    ms_250,
+    ms_500,
+    ms_1000,
+    ms_10,
+    ms_20
+  };
+
+  enum class mode : uint8_t {
+    sleep = 0,
+    forced = 1, // single measurement on request, then back to sleep
+    normal = 3  // measurements one after another, standby time apart
   };
 
-  bme_280(i2c_bus_controller *);
+  /*
+  Defaults are the ones recommended for weather monitoring in section 3.5.1 of
+  the datasheet. Pressure and humidity compensation depends on temperature, so
+  it can't be skipped; skipped pressure or humidity is reported as 0.
+  */
+  struct configuration {
+    oversampling temperature = oversampling::x1;
+    oversampling pressure = oversampling::x1;
+    oversampling humidity = oversampling::x1;
+    filter iir_filter = filter::off;
+    standby standby_time = standby::ms_1000;
+    mode measurement_mode = mode::forced;
+  };
+
+  bme_280(i2c_bus_controller *controller);
+
+  /**
+   * @param controller bus BME280 is connected to.
+   * @param config configuration to apply on initialize().
+   */
+  bme_280(i2c_bus_controller *controller, const configuration &config);
   ~bme_280() = default;
 
+  // Address the driver is bound to, see discover()
+  using i2c_peripheral::bus_address;
+
+  /**
+   * Look for BME280 at both of its addresses, bind to the one with valid Chip
+   * ID.
+   * @return true if BME280 has been found.
+   */
+  bool discover();
+
+  /**
+   * Re-read calibration data and apply configuration, starting a measurement,
+   * i.e. when BME280 is back after losing power.
+   * @param cached calibration data read earlier, i.e. cached across resets.
+   * It's only used if it belongs to this very BME280: checking that takes a
+   * 6 bytes read instead of reading all 32 bytes of calibration data.
+   * @return true on success.
+   */
+  bool initialize(const bme_280_calibration *cached = nullptr);
+
+  /**
+   * Get calibration data in use.
+   * @return calibration data, nullptr if it hasn't been read yet.
+   */
+  const bme_280_calibration *calibration() const {
+    return m_calibrated ? &m_compensation.calibration() : nullptr;
+  }
+
+  /**
+   * Apply new configuration. Forced mode starts a measurement right away,
+   * normal mode starts measuring continuously.
+   * @param config configuration to apply, kept even if BME280 isn't available.
+   * @return true if configuration has been written, false if BME280 isn't
+   * available or temperature measurement is skipped.
+   */
+  bool configure(const configuration &config);
+
+  /**
+   * Get configuration in use.
+   * @return configuration.
+   */
+  const configuration &get_configuration() const { return m_configuration; }
+
   /**
    * Check connectivity by querying Chip ID register and validating it.
    * @return true if BME280 is available for requests over I2C bus.
@@ -40,7 +131,8 @@ public:
   /**
    * Send command to start measurement. Measurement might take some amount of
    * time. To ensure data relevancy, check that the device is done measuring
-   * using @ref bme_280::idle()
+   * using @ref bme_280::idle(). Does nothing in normal mode, BME280 measures on
+   * its own.
    * @return true if command successfuly sent
    */
   bool start_measurement();
@@ -48,18 +140,28 @@ public:
   /**
    * While BME280 is performing measurement or moving data to output registers,
    * it will consider itself busy. This function will check that BME280 is not
-   * doing any of that.
-   * @return true if BME280 is in idle state.
+   * doing any of that. In normal mode it's always busy, though output
+   * registers are kept consistent during a burst read; so it's considered idle
+   * without asking.
+   * @param[out] result true if BME280 is in idle state.
+   * @return true if status has been read.
    */
-  bool idle();
+  bool idle(bool &result);
 
   /**
-   * Get measurement result from the BME280. NOTE: this is fairly expensive
-   * operation in terms of processing time, and, giving the fact that BME280 is
-   * configured to run in the most power efficient mode, there is no need to run
-   * this function more than once per minute.
-   * @param calibration special data type storing device calibration data.
+   * Get the latest measurement result from the BME280 in a single burst read
+   * of its data registers, compensated with the calibration data. In normal
+   * mode that's the most recent sample, a new one is taken every standby time
+   * plus measurement time; reading more often just returns the same sample.
+   * In forced mode, start the measurement and wait until idle first.
+   * @param[out] data compensated measurement result.
+   * @return true if data has been read.
    */
   bool get_data(bme_280::measurement_data &data);
+
+private:
+  uint8_t ctrl_meas_value() const;
+
+  configuration m_configuration;
 };
 
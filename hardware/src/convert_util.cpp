@@ -1,5 +1,9 @@
 #include "convert_util.h"
 
+const uint32_t decimalPowers[10] PROGMEM = {
+    1,      10,      100,      1000,      10000,
+    100000, 1000000, 10000000, 100000000, 1000000000};
+
 uint8_t convertFromBCD(uint8_t value) {
   return ((value & 0xF0) >> 4) * 10 + (value & 0xF);
 }
@@ -13,6 +13,7 @@
 // turn the warnings back on
 #pragma GCC diagnostic pop
 
+#include <avr/pgmspace.h>
 #include <etl/type_traits.h>
 #include <etl/vector.h>
 #include <stdint.h>
@@ -32,6 +33,80 @@ uint8_t convertFromBCD(uint8_t value);
  */
 uint8_t convertToBCD(uint8_t value);
 
+// Powers of ten from 10^0 to 10^9, index is the exponent.
+extern const uint32_t decimalPowers[10] PROGMEM;
+
+// Longest output of format_decimal(): sign, 10 digits and a decimal point.
+#define FORMAT_DECIMAL_MAX_LENGTH 12
+
+/**
+ * Format a number as decimal ASCII digits, most significant digit first,
+ * without any division: 32-bit division is a library call on AVR costing
+ * hundreds of cycles per digit, subtracting powers of ten is much cheaper.
+ * @param value number to format.
+ * @param put callable taking a single char, called for every output char.
+ * @param fraction_digits put a decimal point before that many last digits,
+ * i.e. value of 2346 with 2 fraction digits is "23.46", -5 is "-0.05".
+ * @return amount of chars passed to @p put.
+ */
+template <typename Sink>
+uint8_t format_decimal(int32_t value, Sink &&put, uint8_t fraction_digits = 0) {
+  uint8_t length = 0;
+  uint32_t magnitude = static_cast<uint32_t>(value);
+
+  if (value < 0) {
+    put('-');
+    ++length;
+    magnitude = 0 - magnitude;
+  }
+
+  bool started = false;
+  for (int8_t exponent = 9; exponent >= 0; --exponent) {
+    uint32_t power = pgm_read_dword(&decimalPowers[exponent]);
+    char digit = '0';
+
+    while (magnitude >= power) {
+      magnitude -= power;
+      ++digit;
+    }
+
+    // Skip leading zeros, but keep the one before the decimal point.
+    if (digit != '0' || exponent <= fraction_digits)
+      started = true;
+
+    if (!started)
+      continue;
+
+    if (exponent + 1 == fraction_digits) {
+      put('.');
+      ++length;
+    }
+
+    put(digit);
+    ++length;
+  }
+
+  return length;
+}
+
+/**
+ * Format a number as upper case hexadecimal ASCII digits, most significant
+ * digit first.
+ * @param value number to format.
+ * @param digits amount of digits to output, leading zeros included; up to 8.
+ * @param put callable taking a single char, called for every output char.
+ * @return amount of chars passed to @p put.
+ */
+template <typename Sink>
+uint8_t format_hex(uint32_t value, uint8_t digits, Sink &&put) {
+  for (int8_t nibble = digits - 1; nibble >= 0; --nibble) {
+    uint8_t digit = (value >> (nibble * 4)) & 0xF;
+    put(static_cast<char>(digit < 10 ? '0' + digit : 'A' - 10 + digit));
+  }
+
+  return digits;
+}
+
 template <auto T> using bytevect = etl::vector<uint8_t, T>;
 using ibytevect = etl::ivector<uint8_t>;
 #define alloc_bytevect(X, Y) bytevect<Y> X(Y)
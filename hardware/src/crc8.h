@@ -0,0 +1,184 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+CRC8 of any polynomial and initial value, used by the serial protocol (Maxim/
+Dallas iButton CRC8) and by SCD40 (Sensirion CRC8).
+
+Shifting a byte through CRC bit by bit takes 8 iterations. Instead, CRC of every
+possible nibble or byte can be computed at compile time and kept in flash, which
+trades 16 or 256 bytes of flash per polynomial for 2 or 1 lookups per byte.
+Variant is chosen per build with PLANT_MONITOR_CRC8 (see the top-level
+CMakeLists.txt), only the chosen variant's lookup tables end up in flash.
+*/
+
+#include <avr/pgmspace.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC8_BITWISE 0
+#define CRC8_NIBBLE 1
+#define CRC8_TABLE 2
+
+#ifndef PLANT_MONITOR_CRC8
+#define PLANT_MONITOR_CRC8 CRC8_NIBBLE
+#endif
+
+// Lookup table of CRC8 values, wrapped to be returned from constexpr functions.
+template <uint16_t SIZE> struct crc8_lookup {
+  uint8_t values[SIZE];
+};
+
+/**
+ * CRC8 engine.
+ * @tparam POLYNOMIAL generator polynomial in normal (MSB first) notation,
+ * i.e. 0x31 for x^8 + x^5 + x^4 + 1.
+ * @tparam INIT initial CRC value.
+ * @tparam REFLECTED true if bytes are shifted in LSB first.
+ */
+template <uint8_t POLYNOMIAL, uint8_t INIT, bool REFLECTED> class crc8 {
+public:
+  static constexpr uint8_t init = INIT;
+
+  /**
+   * Shift a byte into CRC bit by bit, no lookup tables involved.
+   * @param crc CRC of the data so far, init for no data.
+   * @param byte next data byte.
+   * @return CRC of the data followed by @p byte.
+   */
+  static constexpr uint8_t update_bitwise(const uint8_t crc,
+                                          const uint8_t byte) {
+    return shift(crc ^ byte, 8);
+  }
+
+  /**
+   * Calculate CRC of a buffer bit by bit, usable at compile time.
+   * @param data raw bytes to calculate CRC for.
+   * @param length amount of bytes in @p data.
+   * @return CRC of @p data. For data with its CRC appended returns 0.
+   */
+  static constexpr uint8_t compute_bitwise(const uint8_t *data,
+                                           const size_t length) {
+    uint8_t crc = INIT;
+
+    for (size_t i = 0; i < length; ++i)
+      crc = update_bitwise(crc, data[i]);
+
+    return crc;
+  }
+
+  /**
+   * Same as update_bitwise(), by two lookups into 16 byte table in flash.
+   */
+  static uint8_t update_nibble(uint8_t crc, const uint8_t byte) {
+    crc ^= byte;
+
+    if (REFLECTED) {
+      crc = (crc >> 4) ^ pgm_read_byte(&m_nibbles.values[crc & 0x0F]);
+      return (crc >> 4) ^ pgm_read_byte(&m_nibbles.values[crc & 0x0F]);
+    }
+
+    crc = (crc << 4) ^ pgm_read_byte(&m_nibbles.values[crc >> 4]);
+    return (crc << 4) ^ pgm_read_byte(&m_nibbles.values[crc >> 4]);
+  }
+
+  /**
+   * Same as update_bitwise(), by a single lookup into 256 byte table in flash.
+   */
+  static uint8_t update_table(const uint8_t crc, const uint8_t byte) {
+    return pgm_read_byte(&m_table.values[crc ^ byte]);
+  }
+
+  /**
+   * Shift a byte into CRC using variant chosen with PLANT_MONITOR_CRC8.
+   */
+  static uint8_t update(const uint8_t crc, const uint8_t byte) {
+#if PLANT_MONITOR_CRC8 == CRC8_TABLE
+    return update_table(crc, byte);
+#elif PLANT_MONITOR_CRC8 == CRC8_NIBBLE
+    return update_nibble(crc, byte);
+#else
+    return update_bitwise(crc, byte);
+#endif
+  }
+
+  /**
+   * Calculate CRC of a buffer.
+   * @param data raw bytes to calculate CRC for.
+   * @param length amount of bytes in @p data.
+   * @return CRC of @p data. For data with its CRC appended returns 0.
+   */
+  static uint8_t compute(const uint8_t *data, const size_t length) {
+    uint8_t crc = INIT;
+
+    for (size_t i = 0; i < length; ++i)
+      crc = update(crc, data[i]);
+
+    return crc;
+  }
+
+private:
+  static constexpr uint8_t reflect(const uint8_t value) {
+    uint8_t result = 0;
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      if (value & (1 << bit))
+        result |= 0x80 >> bit;
+
+    return result;
+  }
+
+  // Shift @p bits of CRC register out, LSB or MSB first
+  static constexpr uint8_t shift(uint8_t crc, const uint8_t bits) {
+    for (uint8_t bit = 0; bit < bits; ++bit) {
+      if (REFLECTED)
+        crc = (crc & 0x01) ? (crc >> 1) ^ reflect(POLYNOMIAL) : (crc >> 1);
+      else
+        crc = (crc & 0x80) ? (crc << 1) ^ POLYNOMIAL : (crc << 1);
+    }
+
+    return crc;
+  }
+
+  /*
+  Entry i is what shifting i out of CRC register leaves in it. For nibbles, i
+  is the outgoing half of the register: the upper one unless reflected.
+  */
+  template <uint16_t SIZE> static constexpr crc8_lookup<SIZE> generate() {
+    constexpr uint8_t bits = SIZE == 16 ? 4 : 8;
+    constexpr uint8_t position = SIZE == 16 && !REFLECTED ? 4 : 0;
+
+    crc8_lookup<SIZE> lookup = {};
+    for (uint16_t i = 0; i < SIZE; ++i)
+      lookup.values[i] = shift(static_cast<uint8_t>(i << position), bits);
+
+    return lookup;
+  }
+
+  static const crc8_lookup<16> m_nibbles;
+  static const crc8_lookup<256> m_table;
+};
+
+template <uint8_t POLYNOMIAL, uint8_t INIT, bool REFLECTED>
+const crc8_lookup<16> crc8<POLYNOMIAL, INIT, REFLECTED>::m_nibbles PROGMEM =
+    crc8<POLYNOMIAL, INIT, REFLECTED>::generate<16>();
+
+template <uint8_t POLYNOMIAL, uint8_t INIT, bool REFLECTED>
+const crc8_lookup<256> crc8<POLYNOMIAL, INIT, REFLECTED>::m_table PROGMEM =
+    crc8<POLYNOMIAL, INIT, REFLECTED>::generate<256>();
+
+// Maxim/Dallas iButton CRC8, same as _crc_ibutton_update() of avr-libc.
+using crc8_maxim = crc8<0x31, 0x00, true>;
+
+// Sensirion CRC8, see "Checksum calculation" in SCD4x datasheet.
+using crc8_sensirion = crc8<0x31, 0xFF, false>;
+
+// Example message of the protocol, CRC is 0x77 (see proto.h)
+static constexpr uint8_t crc8_maxim_example[] = {0x3A, 0x02, 0x01, 0xA0};
+static_assert(crc8_maxim::compute_bitwise(crc8_maxim_example, 4) == 0x77,
+              "Maxim CRC8 doesn't match the protocol example");
+
+// Example of SCD4x datasheet: CRC of 0xBEEF is 0x92
+static constexpr uint8_t crc8_sensirion_example[] = {0xBE, 0xEF};
+static_assert(crc8_sensirion::compute_bitwise(crc8_sensirion_example, 2) ==
+                  0x92,
+              "Sensirion CRC8 doesn't match the datasheet");
@@ -0,0 +1,18 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+// Comparison of timestamps of a wrapping clock, such as timer_manager's one.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Check if @p now has reached @p deadline. Difference is signed to survive wrap
+ * around of the clock, so both must be less than half of its range apart.
+ * @param now current time.
+ * @param deadline time to check against, same clock and units as @p now.
+ * @return true if @p deadline is now or in the past.
+ */
+inline bool time_reached(const uint32_t now, const uint32_t deadline) {
+  return static_cast<int32_t>(now - deadline) >= 0;
+}
@@ -0,0 +1,44 @@
+#include <avr/eeprom.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc8.h"
+#include "device-cache.h"
+
+// EEPROM layout: version, record, then Maxim/Dallas CRC8 of both.
+struct stored_record {
+  uint8_t version;
+  device_cache::record data;
+  uint8_t crc;
+};
+
+static stored_record eeprom_record EEMEM;
+
+static uint8_t crc(const stored_record &r) {
+  return crc8_maxim::compute(reinterpret_cast<const uint8_t *>(&r),
+                             offsetof(stored_record, crc));
+}
+
+bool device_cache::load(record &r) {
+  stored_record stored;
+  eeprom_read_block(&stored, &eeprom_record, sizeof(stored));
+
+  // Erased EEPROM reads as 0xFF, CRC alone would tell it apart as well
+  if (stored.version != DEVICE_CACHE_VERSION || stored.crc != crc(stored)) {
+    memset(&r, 0, sizeof(r));
+    return false;
+  }
+
+  r = stored.data;
+  return true;
+}
+
+void device_cache::store(const record &r) {
+  stored_record stored;
+  memset(&stored, 0, sizeof(stored));
+  stored.version = DEVICE_CACHE_VERSION;
+  stored.data = r;
+  stored.crc = crc(stored);
+
+  eeprom_update_block(&stored, &eeprom_record, sizeof(stored));
+}
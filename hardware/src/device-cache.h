@@ -0,0 +1,40 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Peripheral data worth keeping across resets, stored in EEPROM: BME280
+calibration takes a long read to fetch, SCD40 serial number can't be read at
+all while it's measuring. Cached data is only a hint: drivers revalidate it
+with a short read before use.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bme280-compensation.h"
+
+// Bump whenever the record layout changes, to drop records of the old one
+#define DEVICE_CACHE_VERSION 2
+
+class device_cache {
+public:
+  struct record {
+    uint8_t bme280_address; // 0 if the rest of BME280 data isn't valid
+    bme_280_calibration bme280_calibration;
+    uint64_t scd40_serial_number; // 0 if unknown
+  };
+
+  /**
+   * Load cached data from EEPROM.
+   * @param[out] r record to fill, zeroed if there is no valid one.
+   * @return true if a valid record has been loaded.
+   */
+  static bool load(record &r);
+
+  /**
+   * Store data to EEPROM. Only bytes that differ are written, to spare EEPROM
+   * write cycles; storing the same record again costs a read.
+   * @param r record to store.
+   */
+  static void store(const record &r);
+};
@@ -33,13 +33,18 @@ ds_3231::ds_3231(i2c_bus_controller *controller)
     : i2c_peripheral(DS3231_I2C_ADDRESS, controller) {}
 
 bool ds_3231::available() {
-  etl::vector<uint8_t, 1> tmp(1);
-  return read(DS3231_AGING_OFFSET_REGISTER, tmp);
+  uint8_t tmp = 0;
+  return read<DS3231_AGING_OFFSET_REGISTER>(tmp) == i2c_status::ok;
+}
+
+bool ds_3231::discover() {
+  static const uint8_t addresses[] = {DS3231_I2C_ADDRESS};
+  return i2c_peripheral::discover(addresses);
 }
 
 bool ds_3231::get_temperature(uint16_t &temperature) {
-  alloc_bytevect(response, DS3231_TEMPERATURE_REGISTER_SIZE);
-  if (!read(DS3231_TEMPERATURE_REGISTER, response))
+  uint8_t response[DS3231_TEMPERATURE_REGISTER_SIZE];
+  if (read<DS3231_TEMPERATURE_REGISTER>(response) != i2c_status::ok)
     return false;
 
   temperature = response[0] * 100;
@@ -49,11 +54,10 @@ bool ds_3231::get_temperature(uint16_t &temperature) {
 }
 
 bool ds_3231::get_time(time &t) {
-  etl::vector<uint8_t, DS3231_TIMEDATE_REGISTERS> time_data(
-      DS3231_TIMEDATE_REGISTERS);
+  uint8_t time_data[DS3231_TIMEDATE_REGISTERS];
 
   // Read all time and date registers at once.
-  if (!read(DS3231_FIRST_TIMEDATE_REGISTER, time_data))
+  if (read<DS3231_FIRST_TIMEDATE_REGISTER>(time_data) != i2c_status::ok)
     return false;
 
   t.seconds = convertFromBCD(time_data[0]);
@@ -71,8 +75,7 @@ bool ds_3231::get_time(time &t) {
 }
 
 bool ds_3231::set_time(const time &t) {
-  etl::vector<uint8_t, DS3231_TIMEDATE_REGISTERS> time_data(
-      DS3231_TIMEDATE_REGISTERS);
+  uint8_t time_data[DS3231_TIMEDATE_REGISTERS];
 
   time_data[0] = convertToBCD(t.seconds);
   time_data[1] = convertToBCD(t.minutes);
@@ -82,7 +85,7 @@ bool ds_3231::set_time(const time &t) {
   time_data[5] = convertToBCD(t.month);
   time_data[6] = convertToBCD(t.year);
 
-  if (!write(DS3231_FIRST_TIMEDATE_REGISTER, time_data))
+  if (write<DS3231_FIRST_TIMEDATE_REGISTER>(time_data) != i2c_status::ok)
     return false;
 
   return true;
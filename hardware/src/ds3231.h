@@ -12,6 +12,15 @@ class ds_3231 : protected i2c_peripheral {
 public:
   ds_3231(i2c_bus_controller *);
 
+  // Address the driver is bound to, see discover()
+  using i2c_peripheral::bus_address;
+
+  /**
+   * Probe DS3231 address on the bus.
+   * @return true if DS3231 has been found.
+   */
+  bool discover();
+
   /**
    * Check connectivity by querying Aging Offset Register and waiting for
    * any valid response over I2C bus.
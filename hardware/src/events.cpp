@@ -0,0 +1,85 @@
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "events.h"
+
+static_assert((PLANT_MONITOR_EVENT_QUEUE_SIZE &
+               (PLANT_MONITOR_EVENT_QUEUE_SIZE - 1)) == 0,
+              "PLANT_MONITOR_EVENT_QUEUE_SIZE must be a power of two");
+static_assert(PLANT_MONITOR_EVENT_QUEUE_SIZE <= 128,
+              "Queue indices must be able to tell full queue from empty one");
+
+#define EVENT_QUEUE_MASK (PLANT_MONITOR_EVENT_QUEUE_SIZE - 1)
+
+/*
+Multiple producers, single consumer queue. Interrupts don't nest on AVR, so
+producers are serialized by hardware when posting from interrupts; posting from
+the main loop briefly disables interrupts to get the same guarantee. Only the
+main loop moves the tail.
+*/
+static event queue[PLANT_MONITOR_EVENT_QUEUE_SIZE] = {};
+static volatile uint8_t head = 0;
+static volatile uint8_t tail = 0;
+static volatile uint16_t dropped_events = 0;
+
+static event_queue::handler handlers[event_type_count];
+
+bool event_queue::post(const event_type type, const uint8_t data) {
+  bool posted = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t h = head;
+
+    if (static_cast<uint8_t>(h - tail) < PLANT_MONITOR_EVENT_QUEUE_SIZE) {
+      queue[h & EVENT_QUEUE_MASK] = {type, data};
+      head = h + 1;
+      posted = true;
+    } else {
+      dropped_events = dropped_events + 1;
+    }
+  }
+
+  return posted;
+}
+
+void event_queue::set_handler(const event_type type, handler h) {
+  if (type < event_type_count)
+    handlers[type] = h;
+}
+
+void event_queue::dispatch() {
+  uint8_t t = tail;
+
+  while (t != head) {
+    // Copy the event out first, its slot is free once the tail moves.
+    event e = queue[t & EVENT_QUEUE_MASK];
+    tail = ++t;
+
+    if (e.type < event_type_count && handlers[e.type].is_valid())
+      handlers[e.type](e);
+  }
+}
+
+void event_queue::wait() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+
+  cli();
+  if (tail == head) {
+    sleep_enable();
+    /*
+    Instruction following sei() is always executed before any pending
+    interrupt, so no interrupt can sneak in between the check and the sleep.
+    */
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+}
+
+uint16_t event_queue::dropped() {
+  uint16_t result = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { result = dropped_events; }
+  return result;
+}
@@ -0,0 +1,67 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Interrupt to main loop event queue for plant monitor. Interrupt handlers post
+small typed events and return, the main loop dispatches them one by one to the
+handlers in order of arrival. Unlike flags, events are never merged.
+*/
+
+#include <etl/delegate.h>
+#include <stdint.h>
+
+#ifndef PLANT_MONITOR_EVENT_QUEUE_SIZE
+#define PLANT_MONITOR_EVENT_QUEUE_SIZE 16
+#endif
+
+enum event_type : uint8_t {
+  ev_timers_due,       // a timer might have expired
+  ev_message_received, // a message is waiting in USART receive queue
+  ev_i2c_complete,     // an I2C transaction with a callback is complete
+  event_type_count
+};
+
+struct event {
+  event_type type;
+  uint8_t data; // event-specific
+};
+
+class event_queue {
+public:
+  using handler = etl::delegate<void(const event &)>;
+
+  /**
+   * Post an event. Safe to call from both interrupts and the main loop.
+   * @param type event type.
+   * @param data event-specific data.
+   * @return true if the event is queued, false if the queue is full; the event
+   * is lost and accounted for, see @ref event_queue::dropped().
+   */
+  static bool post(const event_type type, const uint8_t data = 0);
+
+  /**
+   * Set a handler for events of the given type. Events without a handler are
+   * discarded.
+   * @param type event type.
+   * @param h handler to call from @ref event_queue::dispatch().
+   */
+  static void set_handler(const event_type type, handler h);
+
+  /**
+   * Call handlers for all queued events, including the ones posted by the
+   * handlers themselves. Call it from the main loop.
+   */
+  static void dispatch();
+
+  /**
+   * Put CPU to idle sleep until the next interrupt, unless there already are
+   * events to dispatch. Peripherals and timers keep running.
+   */
+  static void wait();
+
+  /**
+   * Get amount of events lost due to full queue.
+   * @return amount of lost events.
+   */
+  static uint16_t dropped();
+};
@@ -0,0 +1,49 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Integer fixed-point arithmetic. ATmega328p has no FPU: a single float division
+pulls the soft-float library into flash and costs hundreds of cycles, while all
+the sensors need is their raw readings scaled by a constant.
+
+Raw readings are Q0.N fractions of a power of two full scale (SCD40 reports
+temperature as 65536ths of 175 C) and results are decimal fixed point (0.01 C),
+so scaling is a multiplication followed by a rounding shift. With a multiplier
+that fits 16 bits it's a single 16x16->32 bit multiplication on AVR, and the
+shift by 16 is just taking the upper word.
+*/
+
+#include <stdint.h>
+
+/**
+ * Drop fraction bits of an unsigned Q-format number, rounding to nearest.
+ * @tparam FRACTION_BITS amount of fraction bits in @p value.
+ * @param value Qm.FRACTION_BITS number.
+ * @return integer part of @p value, rounded half up.
+ */
+template <uint8_t FRACTION_BITS>
+constexpr uint32_t q_round(const uint32_t value) {
+  static_assert(FRACTION_BITS > 0 && FRACTION_BITS < 32,
+                "Amount of fraction bits is out of range");
+
+  // Rounding constant is added after the shift: value + half could overflow
+  return (value >> FRACTION_BITS) +
+         ((value >> (FRACTION_BITS - 1)) & static_cast<uint32_t>(1));
+}
+
+/**
+ * Scale a raw reading by MULTIPLIER / 2^FRACTION_BITS, rounding to nearest.
+ * Overflow is ruled out at compile time for any 16-bit reading.
+ * @tparam MULTIPLIER full scale in output units, i.e. 17500 for 175 C in
+ * 0.01 C units.
+ * @tparam FRACTION_BITS full scale of the reading is 2^FRACTION_BITS.
+ * @param raw reading, Q0.FRACTION_BITS fraction of the full scale.
+ * @return raw * MULTIPLIER / 2^FRACTION_BITS in output units.
+ */
+template <uint32_t MULTIPLIER, uint8_t FRACTION_BITS>
+constexpr uint32_t q_scale(const uint16_t raw) {
+  static_assert(static_cast<uint64_t>(UINT16_MAX) * MULTIPLIER <= UINT32_MAX,
+                "Scaled reading doesn't fit 32 bits");
+
+  return q_round<FRACTION_BITS>(static_cast<uint32_t>(raw) * MULTIPLIER);
+}
@@ -0,0 +1,43 @@
+#include "health.h"
+#include "deadline.h"
+
+bool device_health::due(const uint32_t now_ms) const {
+  if (m_state != health_state::offline)
+    return true;
+
+  return time_reached(now_ms, m_reprobe_ms);
+}
+
+health_state device_health::report(const bool success, const uint32_t now_ms) {
+  if (success) {
+    m_state = health_state::online;
+    m_failures = 0;
+    m_backoff_ms = HEALTH_MIN_BACKOFF_MS;
+    return m_state;
+  }
+
+  if (m_state == health_state::offline) {
+    // Failed reprobe: wait twice as long before the next one
+    if (m_backoff_ms < HEALTH_MAX_BACKOFF_MS / 2)
+      m_backoff_ms *= 2;
+    else
+      m_backoff_ms = HEALTH_MAX_BACKOFF_MS;
+
+    m_reprobe_ms = now_ms + m_backoff_ms;
+    return m_state;
+  }
+
+  if (++m_failures < HEALTH_OFFLINE_FAILURES)
+    m_state = health_state::degraded;
+  else
+    set_offline(now_ms);
+
+  return m_state;
+}
+
+void device_health::set_offline(const uint32_t now_ms) {
+  m_state = health_state::offline;
+  m_failures = HEALTH_OFFLINE_FAILURES;
+  m_backoff_ms = HEALTH_MIN_BACKOFF_MS;
+  m_reprobe_ms = now_ms + m_backoff_ms;
+}
@@ -0,0 +1,65 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Health tracking of a peripheral that might come and go, i.e. a sensor on a
+cable. Failed operations take it from online to degraded, then offline; offline
+peripheral is reprobed with exponential backoff instead of every cycle.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Consecutive failures to consider a peripheral offline
+#ifndef HEALTH_OFFLINE_FAILURES
+#define HEALTH_OFFLINE_FAILURES 3
+#endif
+
+// Time to wait before the first reprobe, doubled after every failed one
+#ifndef HEALTH_MIN_BACKOFF_MS
+#define HEALTH_MIN_BACKOFF_MS 2000
+#endif
+
+#ifndef HEALTH_MAX_BACKOFF_MS
+#define HEALTH_MAX_BACKOFF_MS 256000
+#endif
+
+enum class health_state : uint8_t {
+  online,   // the last operation succeeded
+  degraded, // some of the last operations failed, still worth trying
+  offline   // too many failures, only reprobed once backoff expires
+};
+
+class device_health {
+public:
+  health_state state() const { return m_state; }
+
+  /**
+   * Check whether the peripheral should be talked to.
+   * @param now_ms current time, milliseconds.
+   * @return true if it's online or degraded, or offline and due to be
+   * reprobed.
+   */
+  bool due(const uint32_t now_ms) const;
+
+  /**
+   * Report outcome of an operation with the peripheral, a reprobe included.
+   * @param success true if the operation succeeded.
+   * @param now_ms current time, milliseconds.
+   * @return state after the report, compare it to state() before the report
+   * to catch transitions.
+   */
+  health_state report(const bool success, const uint32_t now_ms);
+
+  /**
+   * Take the peripheral offline right away, i.e. when it's not found at start.
+   * @param now_ms current time, milliseconds.
+   */
+  void set_offline(const uint32_t now_ms);
+
+private:
+  health_state m_state = health_state::online;
+  uint8_t m_failures = 0;
+  uint32_t m_backoff_ms = HEALTH_MIN_BACKOFF_MS;
+  uint32_t m_reprobe_ms = 0;
+};
@@ -1,8 +1,12 @@
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include <util/twi.h>
 
 #include "avr-new.h"
-#include "i2c.h"
+#include "events.h"
+#include "i2c-backend.h"
+#include "timers.h"
 
 /*
 Refer to Atmega328p datasheet, section 21:
@@ -11,9 +15,15 @@ https://ww1.microchip.com/downloads/en/DeviceDoc/Atmel-7810-Automotive-Microcont
 
 #define I2C_PORT PORTC
 #define I2C_DDR DDRC
+#define I2C_PIN PINC
 #define I2C_SCL_PIN 5
 #define I2C_SDA_PIN 4
 
+// Half of SCL period for bus clear, 100 kHz is supported by any peripheral
+#define I2C_BUS_CLEAR_HALF_PERIOD_US 5
+// STOP condition takes a single SCL period, anything longer means bus is stuck
+#define I2C_STOP_TIMEOUT_US 100
+
 class i2c_bus_controller::i2c_bus_impl {
 public:
   i2c_bus_impl(const uint32_t &scl_frequency_hz) {
@@ -23,7 +33,7 @@ public:
     I2C_PORT |= _BV(I2C_SDA_PIN) | _BV(I2C_SCL_PIN);
     I2C_DDR &= ~(_BV(I2C_SDA_PIN) | _BV(I2C_SCL_PIN));
 
-    // Enable I2C(TWI)
+    // Enable I2C(TWI), its interrupt is only enabled during transactions
     TWCR |= _BV(TWEN);
   }
 
@@ -56,153 +66,404 @@ public:
     // Configure data rate in hardware
     TWBR = static_cast<uint8_t>(twbr);
 
+    // Time to transfer a byte and (N)ACK, rounded up
+    m_byte_time_us = 9000000UL / scl_frequency_hz + 1;
+
     // Set prescaler bits
     TWSR |= (_BV(TWPS0) | _BV(TWPS1)) & prescaler;
 
     return true;
   }
 
-  bool send_start() {
-    // Send START condition
-    TWCR = _BV(TWINT) | _BV(TWEN) | (1 << TWSTA);
+  /**
+   * Put a transaction at the end of the queue, start it if the bus is idle.
+   * @param t transaction to queue.
+   */
+  void enqueue(i2c_transaction &t) {
+    bool idle = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { idle = m_queue.push(t); }
 
-    // Wait for TWINT flag to set
-    while (!(TWCR & _BV(TWINT)))
-      ;
+    // Otherwise the interrupt starts it once the transactions ahead are done
+    if (!idle)
+      return;
 
-    // Check error
-    if (TW_STATUS != TW_START && TW_STATUS != TW_REP_START)
-      return false;
+    /*
+    Previous transaction might still be sending its STOP condition. The TWI
+    interrupt is disabled after the last transaction, so wait with interrupts
+    enabled, letting the USART keep up meanwhile.
+    */
+    uint8_t waited_us = 0;
+    while ((TWCR & _BV(TWSTO)) && waited_us < I2C_STOP_TIMEOUT_US) {
+      _delay_us(1);
+      ++waited_us;
+    }
 
-    return true;
+    if (TWCR & _BV(TWSTO))
+      clear_bus();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      begin();
+      send_start();
+    }
   }
 
-  void send_stop() { TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO); }
+  /**
+   * Advance the transaction at the head of the queue by one bus event.
+   * Called from TWI interrupt, see datasheet Unit 21.7 for the status codes.
+   */
+  void step() {
+    i2c_transaction *t = m_queue.head();
+
+    // Nothing to do, just clear the flag
+    if (!t) {
+      TWCR = _BV(TWINT) | _BV(TWEN);
+      return;
+    }
 
-  bool set_address(uint8_t address, bool write) {
-    TWDR = (address << 1) | (uint8_t)(write ? 0 : 1);
-    TWCR = _BV(TWINT) | _BV(TWEN);
+    const i2c_segment &segment = t->segments[m_segment];
+
+    switch (TW_STATUS) {
+    case TW_START:
+    case TW_REP_START:
+      TWDR = (t->address << 1) | (m_reading ? TW_READ : TW_WRITE);
+      proceed();
+      break;
+
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if (m_index < segment.reg_size) {
+        // Register address goes first
+        TWDR = segment.reg[m_index++];
+        proceed();
+      } else if (segment.read) {
+        // Send repeated START to turn the bus around
+        m_reading = true;
+        m_index = 0;
+        send_start();
+      } else if (m_index - segment.reg_size < segment.size) {
+        TWDR = segment.data[m_index++ - segment.reg_size];
+        proceed();
+      } else {
+        next_segment();
+      }
+      break;
+
+    case TW_MR_SLA_ACK:
+      // Do not acknowledge the last byte to be read
+      proceed(segment.size > 1);
+      break;
+
+    case TW_MR_DATA_ACK:
+      segment.data[m_index++] = TWDR;
+      proceed(m_index + 1 < segment.size);
+      break;
+
+    case TW_MR_DATA_NACK:
+      segment.data[m_index] = TWDR;
+      next_segment();
+      break;
+
+    case TW_MT_SLA_NACK:
+    case TW_MR_SLA_NACK:
+      complete(i2c_status::address_nack);
+      break;
+
+    case TW_MT_DATA_NACK:
+      complete(i2c_status::data_nack);
+      break;
+
+    case TW_MT_ARB_LOST:
+      complete(i2c_status::arbitration_lost);
+      break;
+
+    case TW_NO_INFO:
+      // TWINT isn't actually set, nothing happened yet
+      break;
+
+    default:
+      complete(i2c_status::bus_error);
+    }
+  }
 
-    // Wait for TWINT flag to set
-    while (!(TWCR & _BV(TWINT)))
-      ;
+  /**
+   * Abort the transaction at the head of the queue if it's past its deadline.
+   */
+  void check_timeout() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (!m_queue.head() || now_us() - m_started_us < m_timeout_us)
+        return;
 
-    if (!(TW_STATUS == TW_MT_SLA_ACK || TW_STATUS == TW_MR_SLA_ACK))
-      return false;
+      // Disabling the controller keeps the interrupt away from the transaction
+      TWCR = 0;
+    }
 
-    return true;
+    // Takes up to 100 us, too long to keep other interrupts waiting
+    clear_bus();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (m_queue.finish(i2c_status::timeout, now_us() - m_started_us)) {
+        begin();
+        send_start();
+      } else {
+        cancel_deadline();
+      }
+    }
   }
 
-  bool write_byte(const uint8_t byte) {
-    // Transmit 1 byte
-    TWDR = byte;
-    TWCR = _BV(TWINT) | _BV(TWEN);
+  /**
+   * Deadline of the transaction at the head of the queue has come. Called from
+   * the alarm interrupt: stop the transaction right away, and leave clearing
+   * the bus to check_timeout(), called by the main loop on ev_i2c_complete.
+   */
+  void deadline() {
+    if (!m_queue.head())
+      return;
+
+    // Alarm range is limited, a long transaction may take a few of them
+    uint32_t elapsed_us = now_us() - m_started_us;
+    if (elapsed_us < m_timeout_us) {
+      arm_deadline(m_timeout_us - elapsed_us);
+      return;
+    }
 
-    // Wait for TWINT flag to set
-    while (!(TWCR & _BV(TWINT)))
-      ;
+    TWCR = 0;
+    event_queue::post(ev_i2c_complete);
+  }
 
-    // Wait for ACK
-    if (TW_STATUS != TW_MT_DATA_ACK)
-      return false;
+  /**
+   * Wait for the controller in a polling loop, when interrupts are disabled.
+   */
+  void poll() {
+    if (TWCR & _BV(TWINT)) {
+      step();
+    } else {
+      _delay_us(1);
+      ++m_polled_us;
+    }
+  }
 
-    return true;
+  i2c_transaction *take_completed() { return m_queue.take_completed(); }
+
+  bool ready() { return (TWCR & _BV(TWEN)) && !m_queue.head(); }
+
+  bool get_stats(const uint8_t index, i2c_device_stats &stats) {
+    return m_queue.get_stats(index, stats);
   }
 
-  bool read_byte(uint8_t &byte, bool sendAck) {
-    TWCR = _BV(TWINT) | _BV(TWEN) | (sendAck ? _BV(TWEA) : 0);
+  void reset_stats() { m_queue.reset_stats(); }
 
-    // Wait for operation to complete
-    while (!(TWCR & _BV(TWINT)))
-      ;
+private:
+  // Prepare to transfer the transaction at the head of the queue.
+  void begin() {
+    i2c_transaction *t = m_queue.head();
 
-    if (sendAck) {
-      if (TW_STATUS != TW_MR_DATA_ACK)
-        return false;
+    t->status = i2c_status::busy;
+    m_segment = 0;
+    begin_segment();
+
+    // Address and the repeated START take a byte each, twice for reads
+    uint16_t bytes = 0;
+    for (uint8_t i = 0; i < t->segment_count; ++i) {
+      const i2c_segment &segment = t->segments[i];
+      bytes += segment.reg_size + segment.size + (segment.read ? 4 : 2);
+    }
+
+    m_started_us = now_us();
+    m_timeout_us = I2C_TIMEOUT_MARGIN_US +
+                   static_cast<uint32_t>(bytes) * m_byte_time_us;
+    arm_deadline(m_timeout_us);
+  }
+
+  /*
+  Have the alarm interrupt abort the transaction at the head of the queue once
+  its deadline comes. Without the timer, i.e. while drivers are constructed,
+  transactions are synchronous, and their callers check the deadline.
+  */
+  void arm_deadline(const uint32_t timeout_us) {
+    if (timer_manager::is_valid())
+      timer_manager::instance().set_alarm(
+          timeout_us, timer_manager_instance::callback::create<
+                          i2c_bus_impl, &i2c_bus_impl::deadline>(*this));
+  }
+
+  void cancel_deadline() {
+    if (timer_manager::is_valid())
+      timer_manager::instance().cancel_alarm();
+  }
+
+  // Prepare to transfer the current segment of the transaction.
+  void begin_segment() {
+    const i2c_segment &segment = m_queue.head()->segments[m_segment];
+
+    m_index = 0;
+    m_reading = segment.read && !segment.reg_size;
+  }
+
+  // Move on to the next segment, or complete the transaction after the last.
+  void next_segment() {
+    if (++m_segment < m_queue.head()->segment_count) {
+      begin_segment();
+      send_start();
     } else {
-      if (TW_STATUS != TW_MR_DATA_NACK)
-        return false;
+      complete(i2c_status::ok);
     }
+  }
 
-    byte = TWDR;
-    return true;
+  // Send START, or repeated START if the bus is already taken.
+  void send_start() {
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
   }
 
-  bool ready() { return (TWCR & _BV(TWEN)) && !(TWCR & _BV(TWINT)); }
-};
+  /*
+  Transactions are timed by timer_manager clock. Drivers talk to the bus from
+  constructors of global objects, before there is any clock: count time spent in
+  the polling loop instead.
+  */
+  uint32_t now_us() {
+    if (timer_manager::is_valid())
+      return timer_manager::instance().now_us();
 
-i2c_bus_controller::i2c_bus_controller(const uint32_t &scl_frequency_hz)
-    : m_impl(new i2c_bus_impl(scl_frequency_hz)) {}
+    return m_polled_us;
+  }
 
-bool i2c_bus_controller::read(const uint8_t address, const ibytevect &reg_addr,
-                              ibytevect &result) {
-  uint8_t length = result.size();
-  if (reg_addr.empty())
-    return false;
+  /*
+  Bring both the controller and the bus to idle state. A peripheral which lost
+  some clocks holds SDA low, waiting to shift out the rest of a byte. The
+  standard cure is to clock SCL up to 9 times until SDA is released, then send
+  STOP (see NXP UM10204, section 3.1.16 "Bus clear"). Disabling TWI module
+  gives pins back to the port, and also resets its state machine.
+  */
+  void clear_bus() {
+    TWCR = 0;
+
+    // Emulate open drain: output drives the line low, input releases it.
+    I2C_PORT &= ~(_BV(I2C_SDA_PIN) | _BV(I2C_SCL_PIN));
+
+    for (uint8_t i = 0; i < 9 && !(I2C_PIN & _BV(I2C_SDA_PIN)); ++i) {
+      I2C_DDR |= _BV(I2C_SCL_PIN);
+      _delay_us(I2C_BUS_CLEAR_HALF_PERIOD_US);
+      I2C_DDR &= ~_BV(I2C_SCL_PIN);
+      _delay_us(I2C_BUS_CLEAR_HALF_PERIOD_US);
+    }
 
-  // Send START condition
-  if (!m_impl->send_start())
-    return false;
+    // START followed by STOP, while SCL is high
+    I2C_DDR |= _BV(I2C_SDA_PIN);
+    _delay_us(I2C_BUS_CLEAR_HALF_PERIOD_US);
+    I2C_DDR &= ~_BV(I2C_SDA_PIN);
+    _delay_us(I2C_BUS_CLEAR_HALF_PERIOD_US);
 
-  //  Set I2C bus address
-  if (!m_impl->set_address(address, true))
-    return false;
+    I2C_PORT |= _BV(I2C_SDA_PIN) | _BV(I2C_SCL_PIN);
+    TWCR = _BV(TWEN);
+  }
 
-  //  Set the first register to read from
-  for (uint8_t i = 0; i < reg_addr.size(); ++i)
-    if (!m_impl->write_byte(reg_addr[i]))
-      return false;
+  // Let hardware continue with the next byte.
+  void proceed(bool ack = false) {
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | (ack ? _BV(TWEA) : 0);
+  }
 
-  // Send repeated START
-  if (!m_impl->send_start())
-    return false;
+  // Finish the transaction at the head of the queue and start the next one.
+  void complete(i2c_status status) {
+    /*
+    STOP is sent on errors as well, leaving the bus to the peripherals.
+    Setting both TWSTO and TWSTA sends STOP followed by START.
+    */
+    if (m_queue.finish(status, now_us() - m_started_us)) {
+      begin();
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWSTA);
+    } else {
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+      cancel_deadline();
+    }
+  }
 
-  if (!m_impl->set_address(address, false))
-    return false;
+  i2c_transaction_queue m_queue;
 
-  //  Read multiple data bytes and send ack after each one
-  for (uint8_t i = 0; i < length - 1; ++i)
-    if (!m_impl->read_byte(result[i], true))
-      return false;
+  // Current segment of the transaction at the head of the queue
+  uint8_t m_segment = 0;
+  // Position in register address, then in data
+  uint8_t m_index = 0;
+  bool m_reading = false;
 
-  //  Read single final data byte and do not send ack
-  if (!m_impl->read_byte(result[length - 1], false))
-    return false;
+  // Deadline of the transaction at the head of the queue
+  uint32_t m_started_us = 0;
+  uint32_t m_timeout_us = 0;
+  uint16_t m_byte_time_us = 0;
+  // Clock used while there is no timer_manager
+  uint32_t m_polled_us = 0;
+};
 
-  // Send STOP condition
-  m_impl->send_stop();
+// Controller serviced by TWI interrupt
+static i2c_bus_controller *twi_controller = nullptr;
 
-  return true;
+ISR(TWI_vect) {
+  if (twi_controller)
+    twi_controller->twi_interrupt();
 }
 
-bool i2c_bus_controller::write(const uint8_t address, const ibytevect &reg_addr,
-                               const ibytevect &data) {
-  uint8_t length = data.size();
-  if (reg_addr.empty())
-    return false;
+i2c_bus_controller::i2c_bus_controller(const uint32_t &scl_frequency_hz)
+    : m_impl(new i2c_bus_impl(scl_frequency_hz)) {
+  twi_controller = this;
+}
 
-  // Send START condition
-  if (!m_impl->send_start())
-    return false;
+i2c_bus_controller::~i2c_bus_controller() { twi_controller = nullptr; }
 
-  // Send address with WRITE flag
-  if (!m_impl->set_address(address, true))
+bool i2c_bus_controller::submit(i2c_transaction &t) {
+  if (!i2c_transaction_queue::valid(t))
     return false;
 
-  // Set the first register to write to
-  for (uint8_t i = 0; i < reg_addr.size(); ++i)
-    if (!m_impl->write_byte(reg_addr[i]))
-      return false;
+  m_impl->enqueue(t);
+  return true;
+}
+
+i2c_status i2c_bus_controller::execute(i2c_transaction &t) {
+  if (!submit(t))
+    return i2c_status::invalid;
+
+  while (t.status == i2c_status::queued || t.status == i2c_status::busy) {
+    /*
+    Peripherals are configured by constructors of global objects, long before
+    interrupts are enabled. Drive the state machine by polling in that case.
+    */
+    if (!(SREG & _BV(SREG_I)))
+      m_impl->poll();
 
-  // Send bytes
-  for (uint8_t i = 0; i < length; ++i)
-    if (!m_impl->write_byte(data[i]))
-      return false;
+    m_impl->check_timeout();
+  }
 
-  // Send STOP condition
-  m_impl->send_stop();
+  return t.status;
+}
 
-  return true;
+i2c_status i2c_bus_controller::transfer(const uint8_t address,
+                                        const i2c_segment *segments,
+                                        const uint8_t count) {
+  i2c_transaction t;
+  t.address = address;
+  t.segments = segments;
+  t.segment_count = count;
+
+  return execute(t);
 }
 
 bool i2c_bus_controller::ready() { return m_impl->ready(); }
+
+void i2c_bus_controller::process_completions() {
+  i2c_transaction *t = m_impl->take_completed();
+
+  while (t) {
+    // Callback may submit the transaction again and overwrite its link
+    i2c_transaction *next = t->next;
+    t->on_complete(*t);
+    t = next;
+  }
+}
+
+void i2c_bus_controller::check_timeout() { m_impl->check_timeout(); }
+
+bool i2c_bus_controller::get_stats(const uint8_t index,
+                                   i2c_device_stats &stats) {
+  return m_impl->get_stats(index, stats);
+}
+
+void i2c_bus_controller::reset_stats() { m_impl->reset_stats(); }
+
+void i2c_bus_controller::twi_interrupt() { m_impl->step(); }
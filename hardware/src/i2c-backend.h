@@ -0,0 +1,80 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Building blocks shared by I2C backends: i2c-avr.cpp drives the TWI module of
+AtMega328p, i2c-host.cpp drives simulated peripherals on a Linux host. Not for
+use outside of backends.
+*/
+
+#include "i2c.h"
+
+/**
+ * Queue of transactions waiting for the bus, followed by a list of complete
+ * transactions waiting for their callbacks. Keeps bus statistics as well.
+ * Unless stated otherwise, methods must not interrupt each other: call them
+ * from an interrupt or an atomic block.
+ */
+class i2c_transaction_queue {
+public:
+  /**
+   * Check that a transaction can be queued.
+   * @param t transaction to check.
+   * @return false if the transaction is already queued or malformed.
+   */
+  static bool valid(const i2c_transaction &t);
+
+  /**
+   * Put a transaction at the end of the queue.
+   * @param t transaction to queue.
+   * @return true if the queue was empty, i.e. @p t must be started right away.
+   */
+  bool push(i2c_transaction &t);
+
+  /**
+   * Get the transaction being transferred.
+   * @return head of the queue, nullptr if the queue is empty.
+   */
+  i2c_transaction *head() const { return m_head; }
+
+  /**
+   * Remove the transaction at the head of the queue, account for it in bus
+   * statistics and hand it back to its owner.
+   * @param status final status of the transaction.
+   * @param duration_us time the transaction took the bus for.
+   * @return the next transaction to start, nullptr if there is none.
+   */
+  i2c_transaction *finish(const i2c_status status, const uint32_t duration_us);
+
+  /**
+   * Detach the list of transactions which completion callbacks are pending.
+   * Safe to call from the main loop.
+   * @return first transaction of the list.
+   */
+  i2c_transaction *take_completed();
+
+  /**
+   * See i2c_bus_controller::get_stats(), safe to call from the main loop.
+   */
+  bool get_stats(const uint8_t index, i2c_device_stats &stats);
+
+  /**
+   * See i2c_bus_controller::reset_stats(), safe to call from the main loop.
+   */
+  void reset_stats();
+
+private:
+  void record(const i2c_transaction &t, const i2c_status status,
+              const uint32_t duration_us);
+
+  // Transactions waiting for the bus, head is the one being transferred
+  i2c_transaction *m_head = nullptr;
+  i2c_transaction *m_tail = nullptr;
+  // Complete transactions with callbacks to call from the main loop
+  i2c_transaction *m_done_head = nullptr;
+  i2c_transaction *m_done_tail = nullptr;
+
+  // Bus statistics, in order of the first transaction to a peripheral
+  i2c_device_stats m_stats[I2C_STATS_DEVICES];
+  uint8_t m_stats_count = 0;
+};
@@ -0,0 +1,201 @@
+#include "i2c-host.h"
+#include "i2c-backend.h"
+
+static i2c_sim_device *sim_devices[I2C_SIM_MAX_DEVICES] = {};
+
+bool i2c_sim_bus::attach(i2c_sim_device &device) {
+  if (find(device.address()))
+    return false;
+
+  for (i2c_sim_device *&slot : sim_devices) {
+    if (!slot) {
+      slot = &device;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void i2c_sim_bus::detach(i2c_sim_device &device) {
+  for (i2c_sim_device *&slot : sim_devices)
+    if (slot == &device)
+      slot = nullptr;
+}
+
+i2c_sim_device *i2c_sim_bus::find(const uint8_t address) {
+  for (i2c_sim_device *slot : sim_devices)
+    if (slot && slot->address() == address)
+      return slot;
+
+  return nullptr;
+}
+
+bool i2c_sim_register_device::start(const bool read) {
+  // Register is selected by the first byte written after START
+  m_register_selected = read;
+  return true;
+}
+
+bool i2c_sim_register_device::write(const uint8_t byte) {
+  if (!m_register_selected) {
+    m_register = byte;
+    m_register_selected = true;
+    return true;
+  }
+
+  m_registers[m_register] = byte;
+  written(m_register++);
+  return true;
+}
+
+uint8_t i2c_sim_register_device::read() { return m_registers[m_register++]; }
+
+class i2c_bus_controller::i2c_bus_impl {
+public:
+  i2c_bus_impl(const uint32_t &scl_frequency_hz)
+      : m_scl_frequency_hz(scl_frequency_hz) {}
+
+  void enqueue(i2c_transaction &t) {
+    // Transactions are executed right away, queue is never longer than one
+    if (!m_queue.push(t))
+      return;
+
+    for (i2c_transaction *next = &t; next;) {
+      uint32_t bits = 0;
+      i2c_status status = execute(*next, bits);
+      next = m_queue.finish(status, bits * 1000000ULL / m_scl_frequency_hz);
+    }
+  }
+
+  i2c_transaction *take_completed() { return m_queue.take_completed(); }
+
+  bool get_stats(const uint8_t index, i2c_device_stats &stats) {
+    return m_queue.get_stats(index, stats);
+  }
+
+  void reset_stats() { m_queue.reset_stats(); }
+
+private:
+  /**
+   * Transfer a transaction to the addressed peripheral.
+   * @param t transaction to transfer.
+   * @param[out] bits amount of SCL clocks taken.
+   * @return final status of the transaction.
+   */
+  i2c_status execute(i2c_transaction &t, uint32_t &bits) {
+    t.status = i2c_status::busy;
+
+    i2c_sim_device *device = i2c_sim_bus::find(t.address);
+    i2c_status status = i2c_status::ok;
+
+    for (uint8_t i = 0; i < t.segment_count && status == i2c_status::ok; ++i)
+      status = execute(device, t.segments[i], bits);
+
+    if (device && device->online())
+      device->stop();
+
+    return status;
+  }
+
+  i2c_status execute(i2c_sim_device *device, const i2c_segment &segment,
+                     uint32_t &bits) {
+    // Every byte takes 8 clocks and (N)ACK
+    if (!segment.read || segment.reg_size) {
+      bits += 9;
+      if (!address(device, false))
+        return i2c_status::address_nack;
+
+      for (uint8_t i = 0; i < segment.reg_size; ++i) {
+        bits += 9;
+        if (!device->write(segment.reg[i]))
+          return i2c_status::data_nack;
+      }
+
+      if (!segment.read) {
+        for (uint8_t i = 0; i < segment.size; ++i) {
+          bits += 9;
+          if (!device->write(segment.data[i]))
+            return i2c_status::data_nack;
+        }
+
+        return i2c_status::ok;
+      }
+    }
+
+    bits += 9;
+    if (!address(device, true))
+      return i2c_status::address_nack;
+
+    for (uint8_t i = 0; i < segment.size; ++i) {
+      bits += 9;
+      segment.data[i] = device->read();
+    }
+
+    return i2c_status::ok;
+  }
+
+  static bool address(i2c_sim_device *device, const bool read) {
+    return device && device->online() && device->start(read);
+  }
+
+  uint32_t m_scl_frequency_hz;
+  i2c_transaction_queue m_queue;
+};
+
+i2c_bus_controller::i2c_bus_controller(const uint32_t &scl_frequency_hz)
+    : m_impl(new i2c_bus_impl(scl_frequency_hz)) {}
+
+i2c_bus_controller::~i2c_bus_controller() = default;
+
+bool i2c_bus_controller::submit(i2c_transaction &t) {
+  if (!i2c_transaction_queue::valid(t))
+    return false;
+
+  m_impl->enqueue(t);
+  return true;
+}
+
+i2c_status i2c_bus_controller::execute(i2c_transaction &t) {
+  if (!submit(t))
+    return i2c_status::invalid;
+
+  return t.status;
+}
+
+i2c_status i2c_bus_controller::transfer(const uint8_t address,
+                                        const i2c_segment *segments,
+                                        const uint8_t count) {
+  i2c_transaction t;
+  t.address = address;
+  t.segments = segments;
+  t.segment_count = count;
+
+  return execute(t);
+}
+
+bool i2c_bus_controller::ready() { return true; }
+
+void i2c_bus_controller::process_completions() {
+  i2c_transaction *t = m_impl->take_completed();
+
+  while (t) {
+    // Callback may submit the transaction again and overwrite its link
+    i2c_transaction *next = t->next;
+    t->on_complete(*t);
+    t = next;
+  }
+}
+
+// Transactions are complete as soon as they are submitted.
+void i2c_bus_controller::check_timeout() {}
+
+bool i2c_bus_controller::get_stats(const uint8_t index,
+                                   i2c_device_stats &stats) {
+  return m_impl->get_stats(index, stats);
+}
+
+void i2c_bus_controller::reset_stats() { m_impl->reset_stats(); }
+
+// There is no TWI module to interrupt.
+void i2c_bus_controller::twi_interrupt() {}
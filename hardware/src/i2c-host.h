@@ -0,0 +1,116 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Host (Linux) I2C backend for PlantMonitor. Instead of TWI module, every
+i2c_bus_controller talks to simulated peripherals attached to a single virtual
+bus. Transactions are executed right away, byte by byte; their duration is the
+time they would take on the real bus at the configured SCL frequency.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "i2c.h"
+
+#ifndef I2C_SIM_MAX_DEVICES
+#define I2C_SIM_MAX_DEVICES 8
+#endif
+
+/// Simulated peripheral, sees the bus just like a real one does.
+class i2c_sim_device {
+  uint8_t m_address;
+  bool m_online = true;
+
+public:
+  i2c_sim_device(const uint8_t address) : m_address(address) {}
+  virtual ~i2c_sim_device() = default;
+
+  uint8_t address() const { return m_address; }
+
+  /**
+   * Disconnect the peripheral from the bus or connect it back. Disconnected
+   * peripheral doesn't acknowledge its address.
+   * @param online true to connect.
+   */
+  void set_online(const bool online) { m_online = online; }
+  bool online() const { return m_online; }
+
+  /**
+   * Called on START or repeated START followed by the peripheral's address.
+   * @param read true if controller is about to read.
+   * @return true to acknowledge the address.
+   */
+  virtual bool start(const bool /*read*/) { return true; }
+
+  /**
+   * Called for every byte written by controller.
+   * @param byte written byte.
+   * @return true to acknowledge the byte.
+   */
+  virtual bool write(const uint8_t byte) = 0;
+
+  /**
+   * Called for every byte read by controller.
+   * @return byte to send.
+   */
+  virtual uint8_t read() = 0;
+
+  /**
+   * Called on STOP, after a transaction with the peripheral.
+   */
+  virtual void stop() {}
+};
+
+/**
+ * Simulated peripheral with a register file: the first byte written after
+ * START selects the register, the rest are written to the registers starting
+ * from the selected one. Reads start from the selected register as well.
+ * Register address auto-increments, like BME280 and DS3231 do.
+ */
+class i2c_sim_register_device : public i2c_sim_device {
+  bool m_register_selected = false;
+
+protected:
+  uint8_t m_registers[256] = {};
+  uint8_t m_register = 0;
+
+  /**
+   * Called after controller has written a register.
+   * @param reg register address.
+   */
+  virtual void written(const uint8_t /*reg*/) {}
+
+public:
+  using i2c_sim_device::i2c_sim_device;
+
+  uint8_t register_value(const uint8_t reg) const { return m_registers[reg]; }
+
+  bool start(const bool read) override;
+  bool write(const uint8_t byte) override;
+  uint8_t read() override;
+};
+
+/// The virtual bus all simulated peripherals are attached to.
+class i2c_sim_bus {
+public:
+  /**
+   * Attach a peripheral to the bus.
+   * @param device peripheral to attach, must outlive the attachment.
+   * @return false if there is no room or the address is taken.
+   */
+  static bool attach(i2c_sim_device &device);
+
+  /**
+   * Detach a peripheral from the bus.
+   * @param device peripheral to detach.
+   */
+  static void detach(i2c_sim_device &device);
+
+  /**
+   * Find a peripheral by its address.
+   * @param address peripheral address.
+   * @return peripheral, nullptr if there is none.
+   */
+  static i2c_sim_device *find(const uint8_t address);
+};
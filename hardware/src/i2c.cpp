@@ -0,0 +1,155 @@
+#include <util/atomic.h>
+
+#include "events.h"
+#include "i2c-backend.h"
+
+static void saturating_add(uint16_t &counter, const uint16_t value) {
+  counter = (counter > UINT16_MAX - value) ? UINT16_MAX : counter + value;
+}
+
+bool i2c_transaction_queue::valid(const i2c_transaction &t) {
+  if (t.status == i2c_status::queued || t.status == i2c_status::busy)
+    return false;
+
+  if (!t.segment_count)
+    return false;
+
+  // Reading nothing isn't possible, the last byte is the one not acknowledged
+  for (uint8_t i = 0; i < t.segment_count; ++i)
+    if (t.segments[i].read && !t.segments[i].size)
+      return false;
+
+  return true;
+}
+
+bool i2c_transaction_queue::push(i2c_transaction &t) {
+  t.status = i2c_status::queued;
+  t.next = nullptr;
+
+  if (m_tail) {
+    m_tail->next = &t;
+    m_tail = &t;
+    return false;
+  }
+
+  m_head = m_tail = &t;
+  return true;
+}
+
+i2c_transaction *i2c_transaction_queue::finish(const i2c_status status,
+                                               const uint32_t duration_us) {
+  i2c_transaction *t = m_head;
+
+  record(*t, status, duration_us);
+
+  m_head = t->next;
+  if (!m_head)
+    m_tail = nullptr;
+
+  t->next = nullptr;
+  if (t->on_complete) {
+    if (m_done_tail)
+      m_done_tail->next = t;
+    else
+      m_done_head = t;
+    m_done_tail = t;
+
+    event_queue::post(ev_i2c_complete);
+  }
+
+  // Transaction must not be touched after this point, its owner may reuse
+  // it as soon as status is updated.
+  t->status = status;
+
+  return m_head;
+}
+
+i2c_transaction *i2c_transaction_queue::take_completed() {
+  i2c_transaction *t = nullptr;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    t = m_done_head;
+    m_done_head = m_done_tail = nullptr;
+  }
+
+  return t;
+}
+
+bool i2c_transaction_queue::get_stats(const uint8_t index,
+                                      i2c_device_stats &stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (index >= m_stats_count)
+      return false;
+
+    stats = m_stats[index];
+  }
+
+  return true;
+}
+
+void i2c_transaction_queue::reset_stats() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { m_stats_count = 0; }
+}
+
+void i2c_transaction_queue::record(const i2c_transaction &t,
+                                   const i2c_status status,
+                                   const uint32_t duration_us) {
+  i2c_device_stats *stats = nullptr;
+  for (uint8_t i = 0; i < m_stats_count && !stats; ++i)
+    if (m_stats[i].address == t.address)
+      stats = &m_stats[i];
+
+  if (!stats) {
+    // Table is full, the rest of peripherals go unaccounted
+    if (m_stats_count == I2C_STATS_DEVICES)
+      return;
+
+    stats = &m_stats[m_stats_count++];
+    *stats = i2c_device_stats();
+    stats->address = t.address;
+  }
+
+  uint16_t duration = duration_us > UINT16_MAX ? UINT16_MAX : duration_us;
+
+  saturating_add(stats->transactions, 1);
+
+  switch (status) {
+  case i2c_status::ok:
+    // Register address and data bytes
+    for (uint8_t i = 0; i < t.segment_count; ++i)
+      saturating_add(stats->bytes, t.segments[i].reg_size + t.segments[i].size);
+    break;
+
+  case i2c_status::address_nack:
+  case i2c_status::data_nack:
+    saturating_add(stats->nacks, 1);
+    break;
+
+  case i2c_status::timeout:
+    saturating_add(stats->timeouts, 1);
+    break;
+
+  default:
+    saturating_add(stats->errors, 1);
+  }
+
+  if (duration < stats->min_us)
+    stats->min_us = duration;
+  if (duration > stats->max_us)
+    stats->max_us = duration;
+  if (stats->total_us <= UINT32_MAX - duration)
+    stats->total_us += duration;
+
+  uint8_t bucket = 0;
+  for (uint16_t d = duration / I2C_STATS_HISTOGRAM_FIRST_US;
+       d && bucket < I2C_STATS_HISTOGRAM_SIZE - 1; d >>= 1)
+    ++bucket;
+
+  saturating_add(stats->histogram[bucket], 1);
+}
+
+bool i2c_bus_controller::probe(const uint8_t address) {
+  // Write of nothing: address, then STOP right away
+  const i2c_segment segment = {};
+  return transfer(address, &segment, 1) == i2c_status::ok;
+}
@@ -7,13 +7,101 @@ AtMega328p/PlantMonitor. This code assumes there is only one primary device on
 the bus and it's this one.
 */
 
-#include "convert_util.h"
+#include <etl/delegate.h>
 #include <etl/memory.h>
 #include <etl/type_traits.h>
-#include <etl/vector.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/*
+Time allowed for a transaction on top of its transfer time at SCL frequency, to
+cover for peripherals stretching the clock and interrupt latency.
+*/
+#ifndef I2C_TIMEOUT_MARGIN_US
+#define I2C_TIMEOUT_MARGIN_US 1000
+#endif
+
+// Amount of peripheral addresses to collect bus statistics for
+#ifndef I2C_STATS_DEVICES
+#define I2C_STATS_DEVICES 4
+#endif
+
+/*
+Transaction duration histogram: bucket 0 counts transactions shorter than
+I2C_STATS_HISTOGRAM_FIRST_US, every next bucket covers twice as long range, the
+last one counts everything longer.
+*/
+#define I2C_STATS_HISTOGRAM_SIZE 8
+#define I2C_STATS_HISTOGRAM_FIRST_US 128
+
+/// Bus statistics of a single peripheral address. Counters saturate.
+struct i2c_device_stats {
+  uint8_t address = 0;
+  uint16_t transactions = 0; // completed transactions, successful or not
+  uint16_t bytes = 0;        // bytes transferred by successful transactions
+  uint16_t nacks = 0;        // address or data not acknowledged
+  uint16_t timeouts = 0;
+  uint16_t errors = 0; // bus errors and lost arbitration
+  uint16_t min_us = UINT16_MAX;
+  uint16_t max_us = 0;
+  uint32_t total_us = 0;
+  uint16_t histogram[I2C_STATS_HISTOGRAM_SIZE] = {};
+
+  uint16_t average_us() const {
+    return transactions ? total_us / transactions : 0;
+  }
+};
+
+/// State of an I2C transaction.
+enum class i2c_status : uint8_t {
+  ok,               // transaction is complete
+  queued,           // transaction waits for the bus
+  busy,             // transaction is being transferred
+  address_nack,     // no peripheral acknowledged the address
+  data_nack,        // peripheral didn't acknowledge written data
+  arbitration_lost, // another controller took the bus
+  bus_error,        // illegal START or STOP condition on the bus
+  timeout,          // transaction took too long, bus has been reset
+  invalid           // transaction can't be executed as given
+};
+
+/**
+ * Part of an I2C transaction: write register address to a peripheral, then
+ * either write or read (after repeated START) data.
+ */
+struct i2c_segment {
+  // Register address, sent to peripheral before anything else
+  const uint8_t *reg = nullptr;
+  uint8_t reg_size = 0;
+  // Data to write, or buffer to read to
+  uint8_t *data = nullptr;
+  uint8_t size = 0;
+  bool read = false;
+};
+
+/**
+ * I2C transaction: one or more segments to the same peripheral, separated by
+ * repeated START, so the whole batch takes a single START and STOP. Owned by
+ * the caller and must stay alive, along with its segments, until it's
+ * complete.
+ */
+struct i2c_transaction {
+  using callback = etl::delegate<void(i2c_transaction &)>;
+
+  uint8_t address = 0;
+  const i2c_segment *segments = nullptr;
+  uint8_t segment_count = 0;
+
+  volatile i2c_status status = i2c_status::ok;
+
+  // Called from the main loop once transaction is complete, may be left empty.
+  callback on_complete;
+
+  // Managed by i2c_bus_controller.
+  i2c_transaction *next = nullptr;
+};
+
 /**
  * Class to control built-in I2C/TWI bus controller as primary device on the
  * bus.
@@ -30,32 +118,27 @@ class i2c_bus_controller {
   i2c_bus_controller &operator=(i2c_bus_controller &&other) = delete;
 
   /**
-   * Read data from I2C bus. Will do burst read if length the capacity of a @p
-   * result is greater than 1.
-   * @param[in] address device address.
-   * @param[in] reg_addr request to send to a peripheral before reading data.
-   * @param[out] result buffer to read data to. If size of a @p
-   * result is greater than 1, function will read multiple registers in a row.
-   * @return true if operation was successful.
+   * Submit a transaction and wait until it's complete or times out.
+   * @param t transaction to execute.
+   * @return final status of the transaction.
    */
-  bool read(const uint8_t addr, const ibytevect &reg_addr, ibytevect &result);
+  i2c_status execute(i2c_transaction &t);
 
   /**
-   * Write data to I2C bus. Will do burst write if @p length is greater than 1.
+   * Transfer a batch of segments to a peripheral in a single transaction.
    * @param address device address.
-   * @param reg_addr request to send to a peripheral before writing data.
-   * If length is greater than 1, function will write multiple registers in a
-   * row.
-   * @param data buffer to read data from.
-   * @return true if operation was successful.
+   * @param segments segments to transfer, in order.
+   * @param count amount of @p segments.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
    */
-  bool write(const uint8_t addr, const ibytevect &reg, const ibytevect &data);
+  i2c_status transfer(const uint8_t address, const i2c_segment *segments,
+                      const uint8_t count);
 
   friend class i2c_peripheral;
 
 public:
   i2c_bus_controller(const uint32_t &scl_frequency_hz = 400000);
-  ~i2c_bus_controller() = default;
+  ~i2c_bus_controller();
 
   /**
    * Check I2C readiness status.
@@ -63,6 +146,80 @@ public:
    * receiving any data.
    */
   bool ready();
+
+  /**
+   * Queue a transaction to be executed in background by TWI interrupt.
+   * Returns immediately; once the transaction is complete its status is
+   * updated and ev_i2c_complete event is posted.
+   * @param t transaction to queue, must stay alive until it's complete.
+   * @return true if the transaction has been queued.
+   */
+  bool submit(i2c_transaction &t);
+
+  /**
+   * Check whether a peripheral is present: send its address alone, followed by
+   * STOP, and wait for acknowledgement.
+   * @param address device address.
+   * @return true if a peripheral acknowledged the address.
+   */
+  bool probe(const uint8_t address);
+
+  /**
+   * Call completion callbacks of finished transactions. Call it from the main
+   * loop on every ev_i2c_complete event.
+   */
+  void process_completions();
+
+  /**
+   * Abort the transaction in progress if it's past its deadline: reset the
+   * controller, clear the bus and move on to the next transaction. Waiting for
+   * a synchronous transaction does it on its own. Background transactions are
+   * stopped by their deadline interrupt, which posts ev_i2c_complete: call it
+   * from the main loop on that event to finish them off.
+   */
+  void check_timeout();
+
+  /**
+   * Get bus statistics of a peripheral. Peripherals are numbered in order of
+   * the first transaction to them, up to I2C_STATS_DEVICES.
+   * @param index index of the peripheral, starting from 0.
+   * @param[out] stats statistics to fill.
+   * @return false if there is no peripheral with such index.
+   */
+  bool get_stats(const uint8_t index, i2c_device_stats &stats);
+
+  /**
+   * Forget bus statistics of all peripherals.
+   */
+  void reset_stats();
+
+  // TWI interrupt handler, not for public use.
+  void twi_interrupt();
+};
+
+/**
+ * Register address of a peripheral, split to bytes at compile time in the order
+ * they are sent: least significant byte first, just like AVR stores integers.
+ * Drivers define their multi-byte addresses accordingly.
+ */
+template <auto address> struct i2c_register {
+  static_assert(etl::is_unsigned<decltype(address)>::value,
+                "register address can only have unsigned integer type");
+
+  static constexpr uint8_t size = sizeof(address);
+
+  struct byte_array {
+    uint8_t data[size];
+  };
+
+  static constexpr byte_array split() {
+    byte_array result = {};
+    for (uint8_t i = 0; i < size; ++i)
+      result.data[i] = (address >> (8 * i)) & 0xFF;
+    return result;
+  }
+
+  static constexpr byte_array bytes = split();
 };
 
 // Base class for implementing secondary devices on the bus
@@ -74,26 +231,181 @@ protected:
   i2c_peripheral(uint8_t bus_address, i2c_bus_controller *bus_controller)
       : m_bus_address(bus_address), m_bus_controller(bus_controller) {}
 
-  template <typename T> bool write(const T &reg_addr, const ibytevect &data) {
-    static_assert(etl::is_unsigned<T>::value,
-                  "reg_addr can only have unsigned integer type");
+  /**
+   * Get the address the peripheral is bound to.
+   * @return device address.
+   */
+  uint8_t bus_address() const { return m_bus_address; }
+
+  /**
+   * Bind the peripheral to another address, i.e. when it's strapped to an
+   * alternative one.
+   * @param bus_address device address.
+   */
+  void set_bus_address(const uint8_t bus_address) {
+    m_bus_address = bus_address;
+  }
+
+  /**
+   * Probe possible addresses of the peripheral in order and bind it to the
+   * first one acknowledged, see i2c_bus_controller::probe().
+   * @param addresses addresses to probe.
+   * @return true if the peripheral has been found, the address is left as is
+   * otherwise.
+   */
+  template <size_t N> bool discover(const uint8_t (&addresses)[N]) {
+    for (uint8_t address : addresses) {
+      if (m_bus_controller->probe(address)) {
+        m_bus_address = address;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Make a segment writing registers of the peripheral, starting from @p reg.
+   * @param data buffer to write data from.
+   * @param size amount of bytes to write, might be 0 to send a bare command.
+   * @return segment to pass to transfer() or submit().
+   */
+  template <auto reg>
+  static i2c_segment write_segment(const uint8_t *data, const uint8_t size) {
+    using r = i2c_register<reg>;
+    // Data is never written to when segment is a write
+    return {r::bytes.data, r::size, const_cast<uint8_t *>(data), size, false};
+  }
+
+  /**
+   * Make a segment writing registers of the peripheral from an object laid out
+   * as registers are. The object must outlive the segment.
+   * @param object object to write, byte by byte.
+   * @return segment to pass to transfer() or submit().
+   */
+  template <auto reg, typename T>
+  static i2c_segment write_segment(const T &object) {
+    static_assert(!etl::is_pointer<T>::value, "pass size along with pointer");
+    return write_segment<reg>(reinterpret_cast<const uint8_t *>(&object),
+                              sizeof(T));
+  }
+  template <auto reg, typename T>
+  static i2c_segment write_segment(const T &&object) = delete;
+
+  /**
+   * Make a segment reading registers of the peripheral, starting from @p reg.
+   * @param[out] data buffer to read data to.
+   * @param size amount of bytes to read.
+   * @return segment to pass to transfer() or submit().
+   */
+  template <auto reg>
+  static i2c_segment read_segment(uint8_t *data, const uint8_t size) {
+    using r = i2c_register<reg>;
+    return {r::bytes.data, r::size, data, size, true};
+  }
+
+  /**
+   * Make a segment reading registers of the peripheral straight into an object
+   * laid out as registers are, i.e. a byte array.
+   * @param[out] object object to read to, byte by byte.
+   * @return segment to pass to transfer() or submit().
+   */
+  template <auto reg, typename T> static i2c_segment read_segment(T &object) {
+    static_assert(!etl::is_pointer<T>::value, "pass size along with pointer");
+    return read_segment<reg>(reinterpret_cast<uint8_t *>(&object), sizeof(T));
+  }
+
+  /**
+   * Make a segment reading the peripheral without selecting a register first,
+   * i.e. the response to a command sent in a transaction before.
+   * @param[out] data buffer to read data to.
+   * @param size amount of bytes to read.
+   * @return segment to pass to transfer() or submit().
+   */
+  static i2c_segment read_segment(uint8_t *data, const uint8_t size) {
+    return {nullptr, 0, data, size, true};
+  }
+
+  /**
+   * Transfer segments to the peripheral in a single transaction and wait for
+   * it to complete.
+   * @param segments segments to transfer, in order.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <size_t N>
+  i2c_status transfer(const i2c_segment (&segments)[N]) {
+    return m_bus_controller->transfer(m_bus_address, segments, N);
+  }
 
-    alloc_bytevect(addr, sizeof(T));
-    for (uint8_t i = 0; i < sizeof(T); ++i)
-      addr[i] = (reg_addr >> (8 * i)) & 0xFF;
+  /**
+   * Send a bare command: register address without data.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <auto reg> i2c_status write() { return write<reg>(nullptr, 0); }
 
-    return m_bus_controller->write(m_bus_address, addr, data);
+  /**
+   * Write registers of the peripheral, starting from @p reg.
+   * @param data buffer to write data from.
+   * @param size amount of bytes to write.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <auto reg>
+  i2c_status write(const uint8_t *data, const uint8_t size) {
+    const i2c_segment segments[] = {write_segment<reg>(data, size)};
+    return transfer(segments);
   }
 
-  template <typename T>
-  bool read(const T &reg_addr, etl::ivector<uint8_t> &data) {
-    static_assert(etl::is_unsigned<T>::value,
-                  "reg_addr can only have unsigned integer type");
+  /**
+   * Write registers of the peripheral from an object laid out as registers are.
+   * @param object object to write, byte by byte.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <auto reg, typename T> i2c_status write(const T &object) {
+    static_assert(!etl::is_pointer<T>::value, "pass size along with pointer");
+    return write<reg>(reinterpret_cast<const uint8_t *>(&object), sizeof(T));
+  }
 
-    alloc_bytevect(addr, sizeof(T));
-    for (uint8_t i = 0; i < sizeof(T); ++i)
-      addr[i] = (reg_addr >> (8 * i)) & 0xFF;
+  /**
+   * Read registers of the peripheral, starting from @p reg.
+   * @param[out] data buffer to read data to.
+   * @param size amount of bytes to read.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <auto reg> i2c_status read(uint8_t *data, const uint8_t size) {
+    const i2c_segment segments[] = {read_segment<reg>(data, size)};
+    return transfer(segments);
+  }
+
+  /**
+   * Read registers of the peripheral straight into an object laid out as
+   * registers are, i.e. a byte array.
+   * @param[out] object object to read to, byte by byte.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  template <auto reg, typename T> i2c_status read(T &object) {
+    static_assert(!etl::is_pointer<T>::value, "pass size along with pointer");
+    return read<reg>(reinterpret_cast<uint8_t *>(&object), sizeof(T));
+  }
 
-    return m_bus_controller->read(m_bus_address, addr, data);
+  /**
+   * Read the peripheral without selecting a register first, see
+   * read_segment().
+   * @param[out] data buffer to read data to.
+   * @param size amount of bytes to read.
+   * @return i2c_status::ok if operation was successful, error code otherwise.
+   */
+  i2c_status read(uint8_t *data, const uint8_t size) {
+    const i2c_segment segments[] = {read_segment(data, size)};
+    return transfer(segments);
+  }
+
+  /**
+   * Queue a transaction to this peripheral, see i2c_bus_controller::submit().
+   * @param t transaction to queue, its address is set to the peripheral's.
+   * @return true if the transaction has been queued.
+   */
+  bool submit(i2c_transaction &t) {
+    t.address = m_bus_address;
+    return m_bus_controller->submit(t);
   }
 };
@@ -2,47 +2,451 @@
 #include <stdlib.h>
 
 #include "avr-gpio.h"
+#include "benchmark.h"
 #include "bme280.h"
+#include "device-cache.h"
 #include "ds3231.h"
+#include "events.h"
+#include "health.h"
 #include "i2c.h"
 #include "proto.h"
+#include "sampling-policy.h"
 #include "scd40.h"
 #include "timers.h"
 #include "usart.h"
 
+static_assert(I2C_STATS_HISTOGRAM_SIZE == PMC_I2C_HISTOGRAM_SIZE,
+              "I2C histogram must fit pmcI2CHistogram message as is");
+
 #define LED_PORT B
 #define LED_PIN 5
 
-plantMessage *inPm = NULL;
+// Measurement period when there is no SCD40 to pace the measurements
+#define MEASUREMENT_PERIOD_S 5
+
+// Period of SCD40 readout schedule report
+#define REPORT_PERIOD_S 3600
+
 plantMessage *outPm = NULL;
 
 uint8_t lastResult = 0;
-volatile bool LEDState = true;
-volatile bool debug = false;
+bool LEDState = true;
+
+/*
+BME280 measures on its own in normal mode, standby time apart: collecting
+measurements takes a single burst read, without control writes and status
+polling every cycle.
+*/
+bme_280::configuration bme280Configuration() {
+  bme_280::configuration config;
+  config.measurement_mode = bme_280::mode::normal;
+  config.standby_time = bme_280::standby::ms_1000;
+  return config;
+}
 
 i2c_bus_controller i2c;
-bme_280 bme280(&i2c);
+bme_280 bme280(&i2c, bme280Configuration());
 ds_3231 ds3231(&i2c);
 scd_40 scd40(&i2c);
 
+// Bus address of every peripheral that isn't offline, 0 otherwise
+uint8_t deviceAddresses[pdCount] = {};
+device_health deviceHealth[pdCount];
+const char *deviceNames[pdCount] = {"BME280", "DS3231", "SCD40"};
+
+// SCD40 measures at full rate only while it's worth it
+sampling_policy scd40Policy;
+
+// Peripheral data cached in EEPROM across resets
+device_cache::record deviceCache = {};
+
+uint8_t secondsSinceMeasurement = 0;
+
 time systemTime = {};
 const char *weekdays[] = {"Monday", "Tuesday",  "Wednesday", "Thursday",
                           "Friday", "Saturday", "Sunday"};
 
-// Note: variables modified by Interrupt callbacks must have volatile keyword.
-volatile bool hasData = false;
+void collectMeasurements();
+void handleIncomingMessages(const event &);
+bool track(const pmDevice device, const bool success);
+void armSCD40Readout();
+void rearmSCD40Readout();
+void applySCD40Policy();
+
+// Called from the receive interrupt, and from the transmit one once there is
+// room for replies again: keep it short, let the main loop do the heavy
+// lifting.
+void serialMessageReceived() { event_queue::post(ev_message_received); }
+
+void processTimers(const event &) {
+  timer_manager::instance().process_callbacks();
+}
+
+void processI2C(const event &) {
+  // Background transaction might have been aborted by its deadline
+  i2c.check_timeout();
+  i2c.process_completions();
+}
+
+void scd40DataReceived(bool success, const scd_40::measurement_data &data) {
+  if (track(pdSCD40, success)) {
+    pmUSARTLogText(plInfo, "SCD40 data\r\n");
+    pmUSARTLogText(plInfo, " CO2 ppm = ");
+    pmUSARTLogNumber(plInfo, data.co2ppm);
+    pmUSARTLogText(plInfo, "\r\n Temperature = ");
+    pmUSARTLogFixed(plInfo, data.temperature, 2);
+    pmUSARTLogText(plInfo, " C \r\n Humidity = ");
+    pmUSARTLogFixed(plInfo, data.humidity, 2);
+    pmUSARTLogText(plInfo, " % \r\n");
+
+    scd40Policy.sample(data.co2ppm, timer_manager::instance().now_ms());
+    applySCD40Policy();
+  } else {
+    pmUSARTLogText(plWarning, "Failed to get SCD40 data\r\n");
+  }
+}
+
+uint8_t busAddress(const pmDevice device) {
+  switch (device) {
+  case pdBME280:
+    return bme280.bus_address();
+  case pdDS3231:
+    return ds3231.bus_address();
+  case pdSCD40:
+    return scd40.bus_address();
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Initialize BME280 with cached calibration, unless it belongs to another
+ * BME280, and cache the calibration in use.
+ * @return true on success.
+ */
+bool initializeBME280() {
+  const bme_280_calibration *cached = nullptr;
+  if (deviceCache.bme280_address == bme280.bus_address())
+    cached = &deviceCache.bme280_calibration;
+
+  if (!bme280.initialize(cached))
+    return false;
+
+  deviceCache.bme280_address = bme280.bus_address();
+  deviceCache.bme280_calibration = *bme280.calibration();
+  device_cache::store(deviceCache);
+
+  return true;
+}
+
+/**
+ * @return true if SCD40 should measure in low power mode, see scd40Policy.
+ */
+bool scd40LowPower() {
+  return scd40Policy.mode(timer_manager::instance().now_ms()) ==
+         sampling_mode::low_power;
+}
+
+/**
+ * Wrap up SCD40 initialization or mode switch: cache its serial number if it's
+ * a new one, follow its samples from now on.
+ * @param success true if measurement has started.
+ */
+void scd40Started(bool success) {
+  if (!track(pdSCD40, success)) {
+    pmUSARTLogText(plWarning, "SCD40 failed to start measurement\r\n");
+    return;
+  }
+
+  // Serial number is 48 bits long
+  const uint64_t serialNumber = scd40.serial_number();
+  if (serialNumber && serialNumber != deviceCache.scd40_serial_number) {
+    deviceCache.scd40_serial_number = serialNumber;
+    device_cache::store(deviceCache);
+
+    pmUSARTLogText(plInfo, "SCD40 serial number 0x");
+    pmUSARTLogHex(plInfo, serialNumber >> 32, 4);
+    pmUSARTLogHex(plInfo, serialNumber, 8);
+    pmUSARTLogText(plInfo, "\r\n");
+  }
+
+  armSCD40Readout();
+
+  // Policy might have changed its mind in the meantime
+  applySCD40Policy();
+}
+
+/**
+ * Begin SCD40 initialization, see scd_40::initialize(). It takes over half a
+ * second, the rest of it goes on from timers and ends up in scd40Started().
+ * @return true if SCD40 has accepted the first command.
+ */
+bool initializeSCD40() {
+  return scd40.initialize(scd40LowPower(), timer_manager::instance().now_ms(),
+                          scd_40::sequence_callback::create<scd40Started>());
+}
+
+void resumeSCD40() { scd40.resume(timer_manager::instance().now_ms()); }
+
+/**
+ * Come back to SCD40 command sequence once its current command is executed.
+ * @param delayMs execution time of the command.
+ * @return false if there is no timer to come back with: the sequence fails
+ * and SCD40 is accounted for a failure by the caller of the sequence.
+ */
+bool scheduleSCD40(uint16_t delayMs) {
+  timer_manager_instance::callback_timer t;
+  t.callback = timer_manager_instance::callback::create<resumeSCD40>();
+  t.repeating = false;
+  // Timers count from now_ms() rounded down, make sure the whole delay passes
+  t.timeout = delayMs + 1;
+  t.id = timer_ids::scd40_sequence;
+
+  if (timer_manager::instance().add_milliseconds_timer(etl::move(t)))
+    return true;
+
+  pmUSARTLogText(plError, "No timer left for SCD40 command sequence\r\n");
+  return false;
+}
+
+/**
+ * Look for a peripheral on the bus and get it ready for measurements: it might
+ * have lost power along with its settings while it was gone.
+ * @param device peripheral to look for.
+ * @return true if the peripheral is found and initialized.
+ */
+bool probe(const pmDevice device) {
+  switch (device) {
+  case pdBME280:
+    return bme280.discover() && initializeBME280();
+  case pdDS3231:
+    return ds3231.discover();
+  case pdSCD40:
+    return scd40.discover() && initializeSCD40();
+  default:
+    return false;
+  }
+}
+
+/**
+ * Report outcome of an operation with a peripheral, log its health changes and
+ * keep the device table up to date.
+ * @param device peripheral the operation was performed with.
+ * @param success true if the operation succeeded.
+ * @return @p success.
+ */
+bool track(const pmDevice device, const bool success) {
+  device_health &health = deviceHealth[device];
+  health_state before = health.state();
+  health_state after =
+      health.report(success, timer_manager::instance().now_ms());
+
+  if (after == before)
+    return success;
+
+  deviceAddresses[device] =
+      after == health_state::offline ? 0 : busAddress(device);
+
+  pmLogLevel level = after == health_state::online ? plInfo : plWarning;
+  pmUSARTLogText(level, deviceNames[device]);
+
+  if (after == health_state::online)
+    pmUSARTLogText(level, " is online\r\n");
+  else if (after == health_state::degraded)
+    pmUSARTLogText(level, " is degraded\r\n");
+  else
+    pmUSARTLogText(level, " is offline\r\n");
+
+  return success;
+}
+
+/**
+ * Check whether a peripheral should be talked to. Offline peripheral is
+ * reprobed once its backoff expires, and re-initialized if it's back.
+ * @param device peripheral to check.
+ * @return true if the peripheral is online or degraded.
+ */
+bool reachable(const pmDevice device) {
+  device_health &health = deviceHealth[device];
+
+  if (!health.due(timer_manager::instance().now_ms()))
+    return false;
+
+  if (health.state() != health_state::offline)
+    return true;
+
+  return track(device, probe(device));
+}
+
+/**
+ * Look for the peripherals on the bus and bind the drivers to them. Absent
+ * ones start offline and are only reprobed now and then.
+ */
+void scanBus() {
+  for (uint8_t i = 0; i < pdCount; ++i) {
+    const pmDevice device = static_cast<pmDevice>(i);
+
+    if (probe(device)) {
+      deviceAddresses[i] = busAddress(device);
+    } else {
+      deviceHealth[i].set_offline(timer_manager::instance().now_ms());
+      deviceAddresses[i] = 0;
+    }
+  }
+
+  for (uint8_t i = 0; i < pdCount; ++i) {
+    pmUSARTLogText(plInfo, deviceNames[i]);
+
+    if (deviceAddresses[i]) {
+      pmUSARTLogText(plInfo, " at 0x");
+      pmUSARTLogHex(plInfo, deviceAddresses[i], 2);
+      pmUSARTLogText(plInfo, "\r\n");
+    } else {
+      pmUSARTLogText(plInfo, " not found\r\n");
+    }
+  }
+}
+
+/**
+ * Check whether it's time to collect measurements by the clock: only while
+ * there is no SCD40 measuring to pace them, see scd40ReadoutDue().
+ * @return true if measurements are due.
+ */
+bool measurementDue() {
+  // Offline SCD40 is reprobed there, and takes over once it's back
+  if (reachable(pdSCD40)) {
+    // Measurement has failed to start: start over until SCD40 goes offline
+    if (!scd40.measuring() && !scd40.busy())
+      track(pdSCD40, initializeSCD40());
+
+    if (scd40.measuring() || scd40.busy()) {
+      secondsSinceMeasurement = 0;
+      return false;
+    }
+  }
+
+  if (++secondsSinceMeasurement < MEASUREMENT_PERIOD_S)
+    return false;
+
+  secondsSinceMeasurement = 0;
+  return true;
+}
+
+/**
+ * Wrap up SCD40 check for new data: collect the measurements if there is a
+ * sample, see scd_40::check_sample().
+ * @param success false if SCD40 didn't respond to the check.
+ */
+void scd40Checked(bool success) {
+  if (track(pdSCD40, success) && scd40.sample_ready())
+    collectMeasurements();
+
+  rearmSCD40Readout();
+}
+
+/*
+SCD40 is only asked for new data when its next sample is expected, instead of
+every second: a single status read per sample, unless the schedule has drifted.
+*/
+void scd40ReadoutDue() {
+  if (!reachable(pdSCD40))
+    return;
+
+  // Goes on in scd40Checked() once SCD40 has executed the check
+  if (!track(pdSCD40, scd40.check_sample(
+                          timer_manager::instance().now_ms(),
+                          scd_40::sequence_callback::create<scd40Checked>())))
+    rearmSCD40Readout();
+}
+
+/**
+ * Schedule the next check of SCD40 once the last one is over, unless SCD40 is
+ * no longer measuring.
+ */
+void rearmSCD40Readout() {
+  // Once SCD40 is offline, it's up to measurementDue() to reprobe it
+  if (scd40.measuring() &&
+      deviceHealth[pdSCD40].state() != health_state::offline)
+    armSCD40Readout();
+}
+
+/**
+ * Schedule the next check of SCD40 for new data, replacing the pending one.
+ */
+void armSCD40Readout() {
+  int32_t remaining = static_cast<int32_t>(
+      scd40.next_check_ms() - timer_manager::instance().now_ms());
+
+  timer_manager_instance::callback_timer t;
+  t.callback = timer_manager_instance::callback::create<scd40ReadoutDue>();
+  t.repeating = false;
+  t.timeout = remaining > 0 ? remaining : 0;
+  t.id = timer_ids::scd40_readout;
+
+  timer_manager::instance().add_milliseconds_timer(etl::move(t));
+}
+
+/**
+ * Switch SCD40 measurement mode if scd40Policy wants the other one. SCD40 has
+ * to be stopped and left alone for a while first, the new mode is started from
+ * a timer and ends up in scd40Started().
+ */
+void applySCD40Policy() {
+  if (!scd40.measuring())
+    return;
+
+  const bool lowPower = scd40LowPower();
+  if (lowPower == scd40.low_power())
+    return;
+
+  if (!track(pdSCD40,
+             scd40.restart(lowPower, timer_manager::instance().now_ms(),
+                           scd_40::sequence_callback::create<scd40Started>())))
+    return;
 
-// Try to keep callbacks short, use the main loop to do the heavy lifting.
-void serialLineIdle() { hasData = true; }
+  pmUSARTLogText(plInfo, lowPower ? "SCD40 switches to low power mode\r\n"
+                                  : "SCD40 switches to full rate\r\n");
+
+  timer_manager::instance().remove_timer(timer_ids::scd40_readout);
+}
+
+/**
+ * Log SCD40 readout schedule activity since the last report.
+ */
+void reportSCD40Schedule() {
+  const scd_40::schedule_stats &schedule = scd40.get_schedule_stats();
+  pmUSARTLogText(plInfo, "SCD40 last hour: ");
+  pmUSARTLogNumber(plInfo, schedule.checks);
+  pmUSARTLogText(plInfo, " wakeups, ");
+  pmUSARTLogNumber(plInfo, schedule.early_checks);
+  pmUSARTLogText(plInfo, " early, ");
+  pmUSARTLogNumber(plInfo, schedule.samples);
+  pmUSARTLogText(plInfo, " samples, ");
+  pmUSARTLogNumber(plInfo, schedule.bytes);
+  pmUSARTLogText(plInfo, " bytes over I2C\r\n");
+
+  scd40.reset_schedule_stats();
+}
 
 void oneSecond() {
   set_pin(LED_PORT, LED_PIN, LEDState);
   LEDState = !LEDState;
 
-  debug = true;
+  if (measurementDue())
+    collectMeasurements();
+  else
+    pmUSARTLogText(plDebug, ".");
 }
 
 void setup() {
+  event_queue::set_handler(ev_timers_due,
+                           event_queue::handler::create<processTimers>());
+  event_queue::set_handler(
+      ev_message_received,
+      event_queue::handler::create<handleIncomingMessages>());
+  event_queue::set_handler(ev_i2c_complete,
+                           event_queue::handler::create<processI2C>());
+
   timer_manager::create();
 
   timer_manager_instance::callback_timer t;
@@ -53,21 +457,47 @@ void setup() {
 
   timer_manager::instance().add_seconds_timer(etl::move(t));
 
-  pmUSARTLineIdleCallback = serialLineIdle;
+  timer_manager_instance::callback_timer report;
+  report.callback =
+      timer_manager_instance::callback::create<reportSCD40Schedule>();
+  report.repeating = true;
+  report.timeout = REPORT_PERIOD_S;
+  report.id = timer_ids::hourly_report;
+
+  timer_manager::instance().add_seconds_timer(etl::move(report));
+
+  pmUSARTMessageReceivedCallback = serialMessageReceived;
+  pmUSARTSendReadyCallback = serialMessageReceived;
 
   pmUSARTInit();
 
-  inPm = pmCreate();
   outPm = pmCreate();
 
-  pmUSARTSendDebugText("Starting...\r\n");
-  if (!scd40.start_measurement())
-    pmUSARTSendDebugText("SCD40 failed to start measurement\r\n");
+  pmUSARTLogText(plInfo, "Starting...\r\n");
+  pmRunBenchmarks();
+
+  if (!device_cache::load(deviceCache))
+    pmUSARTLogText(plInfo, "Device cache is empty\r\n");
+
+  scd40.set_scheduler(scd_40::scheduler::create<scheduleSCD40>());
+
+  scanBus();
+
+  /*
+  Probes of absent peripherals shouldn't take their statistics slots. Only
+  done once: from now on statistics belong to the host, see pmcResetI2CStats.
+  */
+  i2c.reset_stats();
 
   // initialize digital pin LED_BUILTIN as an output.
   set_output_pin(LED_PORT, LED_PIN);
 }
 
+/**
+ * Handle a request and queue a reply to it. The transmit queue must have room
+ * for the reply, see handleIncomingMessages().
+ * @param pm request to handle
+ */
 void handleIncomingMessage(const plantMessage *pm) {
   plantMessageCode code = pmGetMessageCode(pm);
 
@@ -78,21 +508,70 @@ void handleIncomingMessage(const plantMessage *pm) {
     break;
 
   case pmcGetRTCTime:
-    if (ds3231.get_time(systemTime))
+    if (reachable(pdDS3231) && track(pdDS3231, ds3231.get_time(systemTime)))
       pmFillTime(&systemTime, outPm);
     else
       pmFillHardwareError(outPm);
     break;
 
   case pmcSetRTCTime:
-    if (pmGetTime(inPm, &systemTime)) {
-      if (ds3231.set_time(systemTime))
+    if (pmGetTime(pm, &systemTime)) {
+      if (reachable(pdDS3231) &&
+          track(pdDS3231, ds3231.set_time(systemTime)))
         pmFillTime(&systemTime, outPm);
       else
         pmFillHardwareError(outPm);
+    } else {
+      pmFillBadRequest(outPm);
     }
     break;
 
+  case pmcGetI2CStats:
+  case pmcGetI2CHistogram: {
+    uint8_t index = 0;
+    i2c_device_stats stats;
+
+    if (!pmGetI2CDeviceIndex(pm, &index) || !i2c.get_stats(index, stats)) {
+      pmFillBadRequest(outPm);
+    } else if (code == pmcGetI2CStats) {
+      pmI2CStats out;
+      out.address = stats.address;
+      out.transactions = stats.transactions;
+      out.bytes = stats.bytes;
+      out.nacks = stats.nacks;
+      out.timeouts = stats.timeouts;
+      out.errors = stats.errors;
+      out.minUs = stats.transactions ? stats.min_us : 0;
+      out.averageUs = stats.average_us();
+      out.maxUs = stats.max_us;
+      pmFillI2CStats(&out, outPm);
+    } else {
+      pmFillI2CHistogram(stats.address, stats.histogram, outPm);
+    }
+    break;
+  }
+
+  case pmcResetI2CStats:
+    i2c.reset_stats();
+    pmFillI2CStatsReset(outPm);
+    break;
+
+  case pmcGetDevices:
+    pmFillDevices(deviceAddresses, outPm);
+    break;
+
+  case pmcSubscribe: {
+    uint16_t seconds = 0;
+    if (pmGetSubscription(pm, &seconds)) {
+      scd40Policy.subscribe(seconds, timer_manager::instance().now_ms());
+      applySCD40Policy();
+      pmFillSubscription(seconds, outPm);
+    } else {
+      pmFillBadRequest(outPm);
+    }
+    break;
+  }
+
   default:
     pmFillBadRequest(outPm);
   }
@@ -100,136 +579,119 @@ void handleIncomingMessage(const plantMessage *pm) {
   pmUSARTSend(outPm);
 }
 
+void collectMeasurements() {
+  if (reachable(pdDS3231)) {
+    if (track(pdDS3231, ds3231.get_time(systemTime))) {
+      pmUSARTLogText(plInfo, "\r\n");
+      pmUSARTLogNumber(plInfo, systemTime.year);
+      pmUSARTLogText(plInfo, ".");
+      pmUSARTLogNumber(plInfo, systemTime.month);
+      pmUSARTLogText(plInfo, ".");
+      pmUSARTLogNumber(plInfo, systemTime.dayOfMonth);
+      pmUSARTLogText(plInfo, " ");
+
+      pmUSARTLogNumber(plInfo, systemTime.hours);
+      pmUSARTLogText(plInfo, ":");
+      pmUSARTLogNumber(plInfo, systemTime.minutes);
+      pmUSARTLogText(plInfo, ":");
+      pmUSARTLogNumber(plInfo, systemTime.seconds);
+      pmUSARTLogText(plInfo, ", ");
+      pmUSARTLogText(plInfo, weekdays[systemTime.dayOfWeek - 1]);
+
+      uint16_t temperature = 0;
+      if (track(pdDS3231, ds3231.get_temperature(temperature))) {
+        pmUSARTLogText(plInfo, "\r\n DS3231 Temperature = ");
+        pmUSARTLogFixed(plInfo, temperature, 2);
+        pmUSARTLogText(plInfo, " C \r\n");
+      } else {
+        pmUSARTLogText(plWarning, "\r\n DS3231 failed to read temperature.");
+      }
+    } else {
+      pmUSARTLogText(plWarning, "DS3231 failed to read time\r\n");
+    }
+  }
+
+  // Serial requests are served while the readout is in progress
+  if (reachable(pdSCD40) && scd40.measuring() &&
+      !track(pdSCD40, scd40.request_data(
+                          scd_40::data_callback::create<scd40DataReceived>())))
+    pmUSARTLogText(plWarning, "SCD40 failed to start readout\r\n");
+
+  bool idle = false;
+  if (reachable(pdBME280)) {
+    if (track(pdBME280, bme280.idle(idle)) && idle) {
+      bme_280::measurement_data data;
+
+      if (track(pdBME280, bme280.get_data(data))) {
+        pmUSARTLogText(plInfo, "BME280 data\r\n");
+        pmUSARTLogText(plInfo, " Temperature = ");
+        pmUSARTLogFixed(plInfo, data.temperature, 2);
+
+        pmUSARTLogText(plInfo, " C\r\n Pressure = ");
+        pmUSARTLogFixed(plInfo, data.pressure, 2);
+
+        pmUSARTLogText(plInfo, " hPa\r\n Humidity = ");
+        pmUSARTLogFixed(plInfo, data.humidity, 2);
+        pmUSARTLogText(plInfo, " %\r\n\r\n");
+
+        // Sent along with the next check of SCD40 for new data
+        if (reachable(pdSCD40) && scd40.measuring())
+          scd40.set_compensation_pressure(data.pressure / 100);
+      } else
+        pmUSARTLogText(plWarning, "BME280 failed to get data\r\n");
+
+      if (!track(pdBME280, bme280.start_measurement()))
+        pmUSARTLogText(plWarning, "BME280 failed to start measurement\r\n");
+    }
+  }
+}
+
+void handleIncomingMessages(const event &) {
+  // Requests can be pipelined, handle everything queued so far.
+  const plantMessage *request = NULL;
+  pmParseResult result = prUndefined;
+
+  while ((result = pmUSARTPeek(&request)) != prUndefined) {
+    /*
+    Requests have side effects, such as setting the clock, so a request must
+    be handled exactly once: only start on it when its reply is sure to fit.
+    Otherwise keep it queued, the transmit interrupt posts ev_message_received
+    again once some of the replies are sent.
+    */
+    if (!pmUSARTReserve(PMC_MAX_MSG_LENGTH))
+      break;
+
+    switch (result) {
+    case prOk:
+      handleIncomingMessage(request);
+      break;
+
+    case prBadCrc:
+      pmFillBadCRC(outPm);
+      pmUSARTSend(outPm);
+      break;
+
+    case prOversized:
+      pmFillBadRequest(outPm);
+      pmUSARTSend(outPm);
+      break;
+
+    case prUndefined:
+    case prIncomplete:
+      break;
+    }
+
+    pmUSARTConsume();
+  }
+}
+
 // 3a 01 00 70 -- measurement
 // 3a 03 00 e1 -- time
 int main() {
   setup();
 
   while (1) {
-    timer_manager::instance().process_callbacks();
-
-    if (debug) {
-      debug = false;
-
-      if (scd40.measurement_ready()) {
-        scd_40::measurement_data data;
-
-        if (ds3231.available()) {
-          if (ds3231.get_time(systemTime)) {
-            pmUSARTSendDebugText("\r\n");
-            pmUSARTSendDebugNumber(systemTime.year);
-            pmUSARTSendDebugText(".");
-            pmUSARTSendDebugNumber(systemTime.month);
-            pmUSARTSendDebugText(".");
-            pmUSARTSendDebugNumber(systemTime.dayOfMonth);
-            pmUSARTSendDebugText(" ");
-
-            pmUSARTSendDebugNumber(systemTime.hours);
-            pmUSARTSendDebugText(":");
-            pmUSARTSendDebugNumber(systemTime.minutes);
-            pmUSARTSendDebugText(":");
-            pmUSARTSendDebugNumber(systemTime.seconds);
-            pmUSARTSendDebugText(", ");
-            pmUSARTSendDebugText(weekdays[systemTime.dayOfWeek - 1]);
-
-            uint16_t temperature = 0;
-            if (ds3231.get_temperature(temperature)) {
-              pmUSARTSendDebugText("\r\n DS3231 Temperature = ");
-              pmUSARTSendDebugNumber(temperature);
-              pmUSARTSendDebugText(" / 100 C \r\n");
-            } else {
-              pmUSARTSendDebugText("\r\n DS3231 failed to read temperature.");
-            }
-          } else {
-            pmUSARTSendDebugText("DS3231 failed to read time\r\n");
-          }
-        } else {
-          pmUSARTSendDebugText("DS3231 is unavailable\r\n");
-        }
-
-        if (scd40.get_data(data)) {
-          pmUSARTSendDebugText("SCD40 data\r\n");
-          pmUSARTSendDebugText(" CO2 ppm = ");
-          pmUSARTSendDebugNumber(data.co2ppm);
-          pmUSARTSendDebugText("\r\n Temperature = ");
-          pmUSARTSendDebugNumber(data.temperature);
-          pmUSARTSendDebugText(" / 100 C \r\n Humidity = ");
-          pmUSARTSendDebugNumber(data.humidity);
-          pmUSARTSendDebugText(" % \r\n");
-        } else {
-          pmUSARTSendDebugText("Failed to get SCD40 data\r\n");
-        }
-
-        if (bme280.available()) {
-          if (bme280.idle()) {
-            bme_280::measurement_data data;
-
-            if (bme280.get_data(data)) {
-              pmUSARTSendDebugText("BME280 data\r\n");
-              pmUSARTSendDebugText(" Temperature = ");
-              pmUSARTSendDebugNumber(data.temperature);
-
-              pmUSARTSendDebugText(" / 100 C\r\n Pressure = ");
-              pmUSARTSendDebugNumber(data.pressure);
-
-              pmUSARTSendDebugText(" / 10 hPa\r\n Humidity = ");
-              pmUSARTSendDebugNumber(data.humidity);
-              pmUSARTSendDebugText(" %\r\n\r\n");
-
-              if (!scd40.set_compensation_pressure(data.pressure / 10))
-                pmUSARTSendDebugText(
-                    "Failed to set SCD40 compensation pressure\r\n");
-            } else
-              pmUSARTSendDebugText("BME280 failed to get data\r\n");
-
-            if (!bme280.start_measurement())
-              pmUSARTSendDebugText("BME280 failed to start measurement\r\n");
-          }
-        } else {
-          pmUSARTSendDebugText("BME280 is unavailable\r\n");
-        }
-      } else {
-        pmUSARTSendDebugText(".");
-      }
-    }
-
-    if (hasData) {
-      uint8_t *buffer = NULL;
-      uint8_t bytes = pmUSARTCopyReceivedData(&buffer);
-
-      if (bytes) {
-        pmParseResult parseResult = prUndefined;
-
-        do {
-          parseResult = pmParse(buffer, bytes, inPm);
-
-          switch (parseResult) {
-          case prOk:
-            handleIncomingMessage(inPm);
-            break;
-
-          case prBadCrc:
-            pmFillBadCRC(outPm);
-            pmUSARTSend(outPm);
-            break;
-
-          case prIncomplete: // todo: improve
-            if (bytes == USART_BUFFER_SIZE)
-              pmUSARTClearRxBuffer();
-            break;
-
-          case prUndefined:
-            pmUSARTClearRxBuffer();
-            break;
-          }
-        } while (parseResult != prUndefined && parseResult != prIncomplete);
-
-        if (buffer) {
-          free(buffer);
-          buffer = NULL;
-        }
-      }
-      hasData = false;
-    }
+    event_queue::dispatch();
+    event_queue::wait();
   }
 }
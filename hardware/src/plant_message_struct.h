@@ -7,5 +7,5 @@
 struct plantMessage {
   plantMessageCode code;
   uint8_t payloadSize;
-  uint8_t *payload;
+  uint8_t payload[PMC_MAX_PAYLOAD_SIZE];
 };
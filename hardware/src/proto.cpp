@@ -1,9 +1,11 @@
 /// By gh/BortEngineerDude for gh/Luchanso
 
 #include "proto.h"
+#include <avr/io.h>
 #include <stdlib.h>
 #include <string.h>
-#include <util/crc16.h>
+
+#include "crc8.h"
 
 #define PMC_MSG_START_BYTE 0x3A
 #define PMC_MSG_PAYLOAD_OFFSET 3
@@ -20,62 +22,71 @@
  *         damaged. For buffer without a CRC in the end returns the CRC.
  */
 static uint8_t CRC(const uint8_t *buffer, const uint8_t length) {
-  uint8_t crc = 0;
+  return crc8_maxim::compute(buffer, length);
+}
 
-  for (uint8_t i = 0; i < length; i++)
-    crc = _crc_ibutton_update(crc, buffer[i]);
+static_assert(PMC_MESSAGE_POOL_SIZE <= 8,
+              "Message pool usage is tracked by a single byte bitmask");
+static_assert(sizeof(time) <= PMC_MAX_PAYLOAD_SIZE,
+              "time does not fit into plantMessage payload");
 
-  return crc;
-}
+static_assert(1 + 8 * sizeof(uint16_t) <= PMC_MAX_PAYLOAD_SIZE,
+              "I2C statistics do not fit into plantMessage payload");
+static_assert(1 + PMC_I2C_HISTOGRAM_SIZE * sizeof(uint16_t) <=
+                  PMC_MAX_PAYLOAD_SIZE,
+              "I2C histogram does not fit into plantMessage payload");
+
+static plantMessage messagePool[PMC_MESSAGE_POOL_SIZE] = {};
+
+// Bit N is set when messagePool[N] is handed out by pmCreate()
+static uint8_t messagePoolUsage = 0;
 
 /**
- * Adjust payload ptr and payload size inside plantMessage to accomodate
- * required size of payload.
+ * Set payload size inside plantMessage. Payload storage is inline, so there is
+ * nothing to allocate, just check that requested size fits.
  * @param msg[in,out] plantMessage where adjustment must be made
  * @param requiredPayloadSize size of payload that will be written to
  * plantMessage
+ * @return true if @p requiredPayloadSize fits into the message.
  */
-static void adjustPayloadSize(plantMessage *msg, uint8_t requiredPayloadSize) {
-  if (msg->payload) {
-    if (requiredPayloadSize == 0) {
-      free(msg->payload);
-      msg->payload = NULL;
-    } else if (msg->payloadSize != requiredPayloadSize) {
-      msg->payload =
-          static_cast<uint8_t *>(realloc(msg->payload, requiredPayloadSize));
-    }
-  } else if (requiredPayloadSize) {
-    msg->payload = static_cast<uint8_t *>(malloc(requiredPayloadSize));
-  }
+static bool setPayloadSize(plantMessage *msg, uint8_t requiredPayloadSize) {
+  if (requiredPayloadSize > PMC_MAX_PAYLOAD_SIZE)
+    return false;
+
   msg->payloadSize = requiredPayloadSize;
+  return true;
 }
 
 plantMessage *pmCreate() {
-  return static_cast<plantMessage *>(calloc(1, sizeof(plantMessage)));
+  for (uint8_t i = 0; i < PMC_MESSAGE_POOL_SIZE; ++i) {
+    if (messagePoolUsage & _BV(i))
+      continue;
+
+    messagePoolUsage |= _BV(i);
+    memset(&messagePool[i], 0, sizeof(plantMessage));
+    return &messagePool[i];
+  }
+
+  return NULL;
 }
 
 void pmDestroy(plantMessage *msg) {
-  if (!msg)
+  if (msg < messagePool || msg >= messagePool + PMC_MESSAGE_POOL_SIZE)
     return;
 
-  if (msg->payload)
-    free(msg->payload);
-
-  free(msg);
-
-  msg = NULL;
+  messagePoolUsage &= ~_BV(msg - messagePool);
 }
 
 bool pmFillADCResult(const uint8_t ADCValue, plantMessage *result) {
-  adjustPayloadSize(result, 1);
+  setPayloadSize(result, 1);
   result->code = pmcMeasurementResult;
-  *result->payload = ADCValue;
+  result->payload[0] = ADCValue;
 
   return true;
 }
 
 bool pmFillTime(const time *const t, struct plantMessage *result) {
-  adjustPayloadSize(result, sizeof(time));
+  setPayloadSize(result, sizeof(time));
   result->code = pmcRTCTime;
 
   // We can get away with this on 8-bit CPU due to basically non-existent memory
@@ -98,22 +109,107 @@ bool pmGetTime(const plantMessage *const input, time *t) {
   return true;
 }
 
+/**
+ * Write a 16-bit value in little endian byte order.
+ * @param[out] output where to write value to
+ * @param value value to write
+ * @return position right after the written value.
+ */
+static uint8_t *putUInt16(uint8_t *output, const uint16_t value) {
+  output[0] = value & 0xFF;
+  output[1] = value >> 8;
+  return output + 2;
+}
+
+bool pmGetI2CDeviceIndex(const plantMessage *const input, uint8_t *index) {
+  if (!(input->code == pmcGetI2CStats || input->code == pmcGetI2CHistogram) ||
+      input->payloadSize != 1)
+    return false;
+
+  *index = input->payload[0];
+  return true;
+}
+
+bool pmFillI2CStats(const pmI2CStats *const stats, plantMessage *result) {
+  setPayloadSize(result, 1 + 8 * sizeof(uint16_t));
+  result->code = pmcI2CStats;
+
+  uint8_t *output = result->payload;
+  *output++ = stats->address;
+  output = putUInt16(output, stats->transactions);
+  output = putUInt16(output, stats->bytes);
+  output = putUInt16(output, stats->nacks);
+  output = putUInt16(output, stats->timeouts);
+  output = putUInt16(output, stats->errors);
+  output = putUInt16(output, stats->minUs);
+  output = putUInt16(output, stats->averageUs);
+  putUInt16(output, stats->maxUs);
+
+  return true;
+}
+
+bool pmFillI2CHistogram(const uint8_t address, const uint16_t *buckets,
+                        plantMessage *result) {
+  setPayloadSize(result, 1 + PMC_I2C_HISTOGRAM_SIZE * sizeof(uint16_t));
+  result->code = pmcI2CHistogram;
+
+  uint8_t *output = result->payload;
+  *output++ = address;
+  for (uint8_t i = 0; i < PMC_I2C_HISTOGRAM_SIZE; ++i)
+    output = putUInt16(output, buckets[i]);
+
+  return true;
+}
+
+bool pmFillI2CStatsReset(plantMessage *result) {
+  setPayloadSize(result, 0);
+  result->code = pmcResetI2CStats;
+
+  return true;
+}
+
+bool pmFillDevices(const uint8_t *addresses, plantMessage *result) {
+  setPayloadSize(result, pdCount);
+  result->code = pmcDevices;
+
+  for (uint8_t i = 0; i < pdCount; ++i)
+    result->payload[i] = addresses[i];
+
+  return true;
+}
+
+bool pmGetSubscription(const plantMessage *const input, uint16_t *seconds) {
+  if (input->code != pmcSubscribe || input->payloadSize != sizeof(uint16_t))
+    return false;
+
+  *seconds = input->payload[0] | (input->payload[1] << 8);
+  return true;
+}
+
+bool pmFillSubscription(const uint16_t seconds, plantMessage *result) {
+  setPayloadSize(result, sizeof(uint16_t));
+  result->code = pmcSubscribe;
+  putUInt16(result->payload, seconds);
+
+  return true;
+}
+
 bool pmFillHardwareError(plantMessage *result) {
-  adjustPayloadSize(result, 0);
+  setPayloadSize(result, 0);
   result->code = pmcHardwareError;
 
   return true;
 }
 
 bool pmFillBadCRC(plantMessage *result) {
-  adjustPayloadSize(result, 0);
+  setPayloadSize(result, 0);
   result->code = pmcBadCRC;
 
   return true;
 }
 
 bool pmFillBadRequest(plantMessage *result) {
-  adjustPayloadSize(result, 0);
+  setPayloadSize(result, 0);
   result->code = pmcBadRequest;
 
   return true;
@@ -121,52 +217,63 @@ bool pmFillBadRequest(plantMessage *result) {
 
 plantMessageCode pmGetMessageCode(const plantMessage *msg) { return msg->code; }
 
-pmParseResult pmParse(uint8_t *buffer, uint8_t bufferSize,
-                      plantMessage *result) {
-  if (!buffer || !result)
-    return prUndefined;
-
-  if (bufferSize < PMC_MIN_MSG_LENGTH)
-    return prIncomplete;
-
-  uint8_t *iterator = buffer;
-  uint8_t *end = iterator + bufferSize;
+void pmParserReset(pmParser *parser) { memset(parser, 0, sizeof(pmParser)); }
 
-  // Find message start
-  while (iterator != end) {
-    if (*iterator == PMC_MSG_START_BYTE)
-      break;
+pmParseResult pmParserFeed(pmParser *parser, const uint8_t byte,
+                           plantMessage *result) {
+  parser->crc = crc8_maxim::update(parser->crc, byte);
 
-    ++iterator;
-  }
+  switch (parser->stage) {
+  case ppsStart:
+    if (byte != PMC_MSG_START_BYTE)
+      return prUndefined;
 
-  if (iterator == end)
-    return prUndefined;
+    parser->crc = crc8_maxim::update(crc8_maxim::init, byte);
+    parser->stage = ppsCode;
+    return prIncomplete;
 
-  if (end - iterator < 3)
+  case ppsCode:
+    result->code = static_cast<plantMessageCode>(byte);
+    parser->stage = ppsLength;
     return prIncomplete;
 
-  bufferSize = end - iterator;
-  uint8_t payloadLength = iterator[2];
-  uint8_t msgSize = PMC_MIN_MSG_LENGTH + payloadLength;
+  case ppsLength:
+    /*
+    There is no point waiting for the rest of a message we can't store. Skip
+    it along with its CRC though: its payload may contain the start marker.
+    */
+    if (!setPayloadSize(result, byte)) {
+      parser->received = byte;
+      parser->stage = ppsSkip;
+      return prOversized;
+    }
 
-  if (bufferSize < msgSize)
+    parser->received = 0;
+    parser->stage = byte ? ppsPayload : ppsCrc;
     return prIncomplete;
 
-  if (CRC(iterator, msgSize)) {
-    memset(buffer, 0, msgSize);
-    return prBadCrc;
-  }
+  case ppsPayload:
+    result->payload[parser->received] = byte;
+    if (++parser->received == result->payloadSize)
+      parser->stage = ppsCrc;
+    return prIncomplete;
 
-  adjustPayloadSize(result, payloadLength);
+  case ppsCrc:
+    parser->stage = ppsStart;
 
-  if (payloadLength)
-    memcpy(result->payload, iterator + PMC_MSG_PAYLOAD_OFFSET, payloadLength);
+    // CRC of a message with a correct CRC appended at the end is always 0.
+    return parser->crc ? prBadCrc : prOk;
 
-  result->code = static_cast<plantMessageCode>(iterator[1]);
-  memset(buffer, 0, msgSize);
+  case ppsSkip:
+    // Payload bytes, then the CRC
+    if (parser->received)
+      --parser->received;
+    else
+      parser->stage = ppsStart;
+    return prUndefined;
+  }
 
-  return prOk;
+  return prUndefined;
 }
 
 bool pmSerialize(const plantMessage *input, uint8_t *buffer,
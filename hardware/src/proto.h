@@ -25,6 +25,28 @@ Hence, the smallest possible message using this protocol is 4 bytes long.
 
 #define PMC_MIN_MSG_LENGTH 4
 
+/*
+Every plantMessage carries its payload inline, so the payload size is bounded at
+compile time. Messages with a larger payload are rejected by the parser.
+The largest message sent is I2C statistics, 17 bytes.
+*/
+#ifndef PMC_MAX_PAYLOAD_SIZE
+#define PMC_MAX_PAYLOAD_SIZE 20
+#endif
+
+// Amount of duration buckets in pmcI2CHistogram message
+#define PMC_I2C_HISTOGRAM_SIZE 8
+
+#define PMC_MAX_MSG_LENGTH (PMC_MIN_MSG_LENGTH + PMC_MAX_PAYLOAD_SIZE)
+
+/*
+Messages are handed out by pmCreate() from a static pool instead of the heap,
+this is the amount of messages that can be alive at the same time.
+*/
+#ifndef PMC_MESSAGE_POOL_SIZE
+#define PMC_MESSAGE_POOL_SIZE 4
+#endif
+
 /// Plant message code, huh.
 typedef enum {
   pmcUndefined = 0,
@@ -34,6 +56,14 @@ typedef enum {
   pmcRTCTime = 4,
   pmcSetRTCTime = 5,
   pmcSetWakeUpInterval = 6,
+  pmcGetI2CStats = 7,     // payload: peripheral index
+  pmcI2CStats = 8,        // payload: pmI2CStats, 16-bit values little endian
+  pmcGetI2CHistogram = 9, // payload: peripheral index
+  pmcI2CHistogram = 10,   // payload: address, 16-bit duration buckets
+  pmcResetI2CStats = 11,  // no payload, echoed back once done
+  pmcGetDevices = 12,     // no payload
+  pmcDevices = 13,        // payload: address of every pmDevice, 0 if absent
+  pmcSubscribe = 14,      // payload: seconds of full rate, 16-bit, echoed back
   pmcHardwareError = 253,
   pmcBadCRC = 254,
   pmcBadRequest = 255
@@ -41,16 +71,51 @@ typedef enum {
 
 typedef struct plantMessage plantMessage;
 
+/// I2C peripherals known to PlantMonitor, in order of pmcDevices payload.
+typedef enum { pdBME280 = 0, pdDS3231, pdSCD40, pdCount } pmDevice;
+
+/// Bus statistics of an I2C peripheral, see pmFillI2CStats().
+typedef struct {
+  uint8_t address;
+  uint16_t transactions;
+  uint16_t bytes;
+  uint16_t nacks;
+  uint16_t timeouts;
+  uint16_t errors;
+  uint16_t minUs;
+  uint16_t averageUs;
+  uint16_t maxUs;
+} pmI2CStats;
+
+/// Stage of the incremental parser, i.e. which message field comes next.
+typedef enum {
+  ppsStart = 0, // waiting for message start marker
+  ppsCode,
+  ppsLength,
+  ppsPayload,
+  ppsCrc,
+  ppsSkip // skipping the rest of a rejected message
+} pmParserStage;
+
+/// Incremental parser state, see pmParserFeed().
+typedef struct {
+  pmParserStage stage;
+  uint8_t crc;      // CRC of the message received so far
+  uint8_t received; // payload bytes received so far, or left to skip
+} pmParser;
+
 typedef enum {
   prUndefined = 0, // no attempt to parse message was made
   prOk,            // message succesfully fetched
   prBadCrc,        // message failed to pass CRC
-  prIncomplete     // message is yet to be received completely
+  prIncomplete,    // message is yet to be received completely
+  prOversized      // message payload exceeds PMC_MAX_PAYLOAD_SIZE
 } pmParseResult;
 
 /**
- * Create a plant message.
- * @return zero-initialized plantMessage.
+ * Create a plant message. Messages are taken from a static pool of
+ * PMC_MESSAGE_POOL_SIZE entries, no heap memory is involved.
+ * @return zero-initialized plantMessage or NULL if the pool is exhausted.
  */
 plantMessage *pmCreate();
 
@@ -78,6 +143,64 @@ bool pmFillTime(const time *const t, struct plantMessage *result);
  */
 bool pmGetTime(const plantMessage *const input, time *t);
 
+/**
+ * Get index of the I2C peripheral requested by pmcGetI2CStats or
+ * pmcGetI2CHistogram message.
+ * @param[in] input a plantMessage to get index from
+ * @param[out] index index of the peripheral
+ * @return true on success.
+ */
+bool pmGetI2CDeviceIndex(const plantMessage *const input, uint8_t *index);
+
+/**
+ * Fill a @p result with I2C bus statistics of a peripheral.
+ * @param[in] stats statistics to send
+ * @param[out] result message to fill
+ * @return true on success.
+ */
+bool pmFillI2CStats(const pmI2CStats *const stats, plantMessage *result);
+
+/**
+ * Fill a @p result with I2C transaction duration histogram of a peripheral.
+ * @param[in] address peripheral address
+ * @param[in] buckets PMC_I2C_HISTOGRAM_SIZE duration buckets
+ * @param[out] result message to fill
+ * @return true on success.
+ */
+bool pmFillI2CHistogram(const uint8_t address, const uint16_t *buckets,
+                        plantMessage *result);
+
+/**
+ * Fill a @p result with I2C statistics reset confirmation.
+ * @param[out] result message to fill
+ * @return true on success.
+ */
+bool pmFillI2CStatsReset(plantMessage *result);
+
+/**
+ * Fill a @p result with the table of I2C peripherals found on the bus.
+ * @param[in] addresses pdCount addresses in pmDevice order, 0 if absent
+ * @param[out] result message to fill
+ * @return true on success.
+ */
+bool pmFillDevices(const uint8_t *addresses, plantMessage *result);
+
+/**
+ * Get duration of the full rate measurements requested by pmcSubscribe message.
+ * @param[in] input a plantMessage to get duration from
+ * @param[out] seconds requested duration, 0 to cancel
+ * @return true on success.
+ */
+bool pmGetSubscription(const plantMessage *const input, uint16_t *seconds);
+
+/**
+ * Fill a @p result with full rate measurements subscription confirmation.
+ * @param[in] seconds subscription duration
+ * @param[out] result message to fill
+ * @return true on success.
+ */
+bool pmFillSubscription(const uint16_t seconds, plantMessage *result);
+
 /**
  * Fill a @p result with a Harware Error message.
  * @param[out] result message to fill
@@ -107,8 +230,8 @@ bool pmFillBadRequest(plantMessage *result);
 plantMessageCode pmGetMessageCode(const plantMessage *msg);
 
 /**
- * Delete a plant message in a proper manner.
- * @param[in,out] msg message to destroy. Will be NULL after running the
+ * Return a plant message to the pool it was taken from.
+ * @param[in] msg message to destroy. Must not be used after running the
  * function.
  */
 void pmDestroy(plantMessage *msg);
@@ -125,17 +248,28 @@ bool pmSerialize(const plantMessage *input, uint8_t *buffer,
                  uint8_t *bufferSize);
 
 /**
- * Attempt to parse a message
- * @param[in]  buffer raw received data buffer
- * @param[in]  bufferSize buffer data size
- * @param[out] result parsed message
- * @return enum pmcParseResult describing state of message stored by result
- * pointer. NOTE: On succesful result or bad CRC raw message will be overwritten
- * by 0's in @p buffer, if message is incomplete @p buffer will remain
- * untouched.
+ * Reset the parser, dropping any partially received message.
+ * @param[out] parser parser to reset
+ */
+void pmParserReset(pmParser *parser);
+
+/**
+ * Feed a single received byte to the parser. Does a constant amount of work
+ * per byte, so it is safe to call straight from the receive interrupt.
+ * Bytes outside of a message are skipped until the next start marker.
+ * @param[in,out] parser parser state
+ * @param[in] byte received byte
+ * @param[out] result message being assembled. Its content is only valid once
+ * prOk is returned, and must stay untouched while the message is incomplete.
+ * @return prUndefined if @p byte was skipped, prIncomplete if @p byte belongs
+ * to a message yet to be received completely, prOk when the message stored in
+ * @p result is complete, prBadCrc or prOversized if the message was rejected.
+ * After prOversized the rest of the message, as long as its length says, is
+ * skipped; after any other result but prIncomplete parser waits for a new
+ * message.
  */
-pmParseResult pmParse(uint8_t *buffer, uint8_t bufferSize,
-                      plantMessage *result);
+pmParseResult pmParserFeed(pmParser *parser, const uint8_t byte,
+                           plantMessage *result);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,51 @@
+#include "sampling-policy.h"
+#include "deadline.h"
+
+/*
+Reference older than that, i.e. SCD40 was gone for a while, tells nothing about
+how fast CO2 changes now.
+*/
+#define SAMPLING_STALE_REFERENCE_MS (4UL * SAMPLING_RATE_WINDOW_MS)
+
+void sampling_policy::sample(const uint16_t co2ppm, const uint32_t now_ms) {
+  const uint32_t elapsed_ms = now_ms - m_reference_ms;
+
+  if (!m_has_reference || elapsed_ms > SAMPLING_STALE_REFERENCE_MS) {
+    m_reference_ppm = co2ppm;
+    m_reference_ms = now_ms;
+    m_has_reference = true;
+    return;
+  }
+
+  if (elapsed_ms < SAMPLING_RATE_WINDOW_MS)
+    return;
+
+  const uint32_t change = co2ppm > m_reference_ppm ? co2ppm - m_reference_ppm
+                                                   : m_reference_ppm - co2ppm;
+
+  // change / elapsed >= threshold / minute, without division
+  if (change * 60000 >= SAMPLING_FAST_PPM_PER_MINUTE * elapsed_ms) {
+    m_changing_until_ms = now_ms + SAMPLING_HOLD_MS;
+    m_changing = true;
+  }
+
+  m_reference_ppm = co2ppm;
+  m_reference_ms = now_ms;
+}
+
+void sampling_policy::subscribe(const uint16_t seconds, const uint32_t now_ms) {
+  m_subscribed_until_ms = now_ms + static_cast<uint32_t>(seconds) * 1000;
+  m_subscribed = seconds != 0;
+}
+
+sampling_mode sampling_policy::mode(const uint32_t now_ms) {
+  // Expired deadlines are forgotten, they'd come back once the clock wraps
+  if (m_changing && time_reached(now_ms, m_changing_until_ms))
+    m_changing = false;
+
+  if (m_subscribed && time_reached(now_ms, m_subscribed_until_ms))
+    m_subscribed = false;
+
+  return m_changing || m_subscribed ? sampling_mode::periodic
+                                    : sampling_mode::low_power;
+}
@@ -0,0 +1,71 @@
+#pragma once
+/// By gh/BortEngineerDude for gh/Luchanso
+
+/*
+Choice of SCD40 measurement mode. Periodic measurement samples every 5 seconds,
+low power one every 30: in a room where CO2 barely moves the latter costs a
+sixth of bus transactions and wakeups. Full rate is kept while CO2 is changing
+fast, for a while after it calms down, and while the host asks for it.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+CO2 change rate to switch to full rate at. Rate is measured over at least
+SAMPLING_RATE_WINDOW_MS, SCD40 noise of a few ppm per sample is averaged out.
+*/
+#ifndef SAMPLING_FAST_PPM_PER_MINUTE
+#define SAMPLING_FAST_PPM_PER_MINUTE 20
+#endif
+
+#ifndef SAMPLING_RATE_WINDOW_MS
+#define SAMPLING_RATE_WINDOW_MS 30000
+#endif
+
+// Time to stay at full rate after the last fast change, after start as well
+#ifndef SAMPLING_HOLD_MS
+#define SAMPLING_HOLD_MS 300000
+#endif
+
+enum class sampling_mode : uint8_t {
+  periodic, // full rate, new sample every 5 seconds
+  low_power // new sample every 30 seconds
+};
+
+class sampling_policy {
+public:
+  /**
+   * Account for a new CO2 sample.
+   * @param co2ppm CO2 concentration, ppm.
+   * @param now_ms current time, milliseconds.
+   */
+  void sample(const uint16_t co2ppm, const uint32_t now_ms);
+
+  /**
+   * Keep full rate for the host.
+   * @param seconds how long the host wants full rate for, 0 to cancel.
+   * @param now_ms current time, milliseconds.
+   */
+  void subscribe(const uint16_t seconds, const uint32_t now_ms);
+
+  /**
+   * Get the mode SCD40 should be measuring in.
+   * @param now_ms current time, milliseconds.
+   * @return periodic while CO2 changes fast or the host is subscribed,
+   * low_power otherwise.
+   */
+  sampling_mode mode(const uint32_t now_ms);
+
+private:
+  // Sample the change rate is measured from
+  uint16_t m_reference_ppm = 0;
+  uint32_t m_reference_ms = 0;
+  bool m_has_reference = false;
+
+  // Full rate until then, unless expired
+  uint32_t m_changing_until_ms = SAMPLING_HOLD_MS;
+  bool m_changing = true;
+  uint32_t m_subscribed_until_ms = 0;
+  bool m_subscribed = false;
+};
@@ -1,5 +1,8 @@
 #include "scd40.h"
 #include "convert_util.h"
+#include "crc8.h"
+#include "deadline.h"
+#include "fixed-point.h"
 
 /*
 Refer to SCD4x Datasheet:
@@ -18,6 +21,10 @@ for? (keep in mind, thoose defines are in little endian).
 #define SCD40_START_LOW_POWER_MEASUREMENT (uint16_t)(0xAC21)
 #define SCD40_STOP_MEASUREMENT (uint16_t)(0x863F)
 
+// See "Periodic measurement" and "Low power periodic measurement"
+#define SCD40_PERIOD_MS (uint16_t)5000
+#define SCD40_LOW_POWER_PERIOD_MS (uint16_t)30000
+
 #define SCD40_MEASUREMENT_READY (uint16_t)(0xB8E4)
 #define SCD40_MEASUREMENT_READY_RESP_SIZE (uint8_t)3
 #define SCD40_MEASUREMENT_READY_MASK (uint16_t)(0x7FFF)
@@ -31,59 +38,243 @@ for? (keep in mind, thoose defines are in little endian).
 #define SCD40_GET_SERIAL_NO (uint16_t)(0x8236)
 #define SCD40_GET_SERIAL_NO_RESP_SIZE (uint8_t)9
 
+/*
+Measurement conversion, see "Read measurement" in the datasheet:
+T = -45 + 175 * word / 2^16 C, RH = 100 * word / 2^16 %. Both are kept in 0.01
+units, so full scales are 17500 and 10000.
+*/
+#define SCD40_TEMPERATURE_OFFSET (int16_t)(-4500)
+#define SCD40_TEMPERATURE_SCALE 17500UL
+#define SCD40_HUMIDITY_SCALE 10000UL
+#define SCD40_WORD_BITS 16
+
 // CRC after EACH! TWO! BYTES! OF DATA?! WHY!!?!?
 static uint8_t scd_40_crc(const uint8_t *data, uint8_t count) {
-  uint8_t current_byte;
-  uint8_t crc = 0xFF;
-  uint8_t crc_bit;
-
-  for (current_byte = 0; current_byte < count; ++current_byte) {
-    crc ^= (data[current_byte]);
-
-    for (crc_bit = 8; crc_bit > 0; --crc_bit) {
-      if (crc & 0x80)
-        crc = (crc << 1) ^ 0x31;
-      else
-        crc = (crc << 1);
-    }
-  }
+  return crc8_sensirion::compute(data, count);
+}
+
+static constexpr int16_t scd_40_temperature(const uint16_t word) {
+  return SCD40_TEMPERATURE_OFFSET +
+         static_cast<int16_t>(
+             q_scale<SCD40_TEMPERATURE_SCALE, SCD40_WORD_BITS>(word));
+}
+
+static constexpr uint16_t scd_40_humidity(const uint16_t word) {
+  return q_scale<SCD40_HUMIDITY_SCALE, SCD40_WORD_BITS>(word);
+}
+
+// Datasheet example (25 C, 37 %) and both ends of the range
+static_assert(scd_40_temperature(0x6667) == 2500 &&
+                  scd_40_temperature(0) == -4500 &&
+                  scd_40_temperature(0xFFFF) == 13000,
+              "SCD40 temperature conversion is off");
+static_assert(scd_40_humidity(0x5EB9) == 3700 && scd_40_humidity(0) == 0 &&
+                  scd_40_humidity(0xFFFF) == 10000,
+              "SCD40 humidity conversion is off");
+
+/*
+SCD40 might begin measurement as soon as voltage settles after power on, or be
+left measuring by the previous run of the firmware. It has to be stopped first,
+or it won't give out its serial number.
+*/
+static const scd_40::command initialize_sequence[] = {
+    scd_40::command::stop_measurement, scd_40::command::get_serial_number,
+    scd_40::command::receive_serial_number,
+    scd_40::command::start_measurement};
+static const scd_40::command initialize_low_power_sequence[] = {
+    scd_40::command::stop_measurement, scd_40::command::get_serial_number,
+    scd_40::command::receive_serial_number,
+    scd_40::command::start_low_power_measurement};
+
+static const scd_40::command restart_sequence[] = {
+    scd_40::command::stop_measurement, scd_40::command::start_measurement};
+static const scd_40::command restart_low_power_sequence[] = {
+    scd_40::command::stop_measurement,
+    scd_40::command::start_low_power_measurement};
 
-  return crc;
+/*
+Compensation pressure set since the last check is sent ahead of it: it takes
+the check another millisecond of waiting, but no wakeup of its own.
+*/
+static const scd_40::command check_sequence[] = {
+    scd_40::command::get_data_ready_status,
+    scd_40::command::receive_data_ready_status};
+static const scd_40::command check_with_pressure_sequence[] = {
+    scd_40::command::set_ambient_pressure,
+    scd_40::command::get_data_ready_status,
+    scd_40::command::receive_data_ready_status};
+
+// Measurement itself is read in background once the command is executed
+static const scd_40::command readout_sequence[] = {
+    scd_40::command::read_measurement};
+
+static const scd_40::command available_sequence[] = {
+    scd_40::command::get_ambient_pressure,
+    scd_40::command::receive_ambient_pressure};
+
+/**
+ * Get time SCD40 needs to execute a command.
+ * @return time before the next command can be sent, or its response read,
+ * milliseconds.
+ */
+static uint16_t execution_time_ms(const scd_40::command c) {
+  switch (c) {
+  case scd_40::command::stop_measurement:
+    return SCD40_STOP_DELAY_MS;
+  case scd_40::command::get_serial_number:
+  case scd_40::command::set_ambient_pressure:
+  case scd_40::command::get_ambient_pressure:
+  case scd_40::command::get_data_ready_status:
+  case scd_40::command::read_measurement:
+    return SCD40_COMMAND_DELAY_MS;
+  default:
+    // Periodic measurement accepts its commands right away, and the response
+    // is there once it's read
+    return 0;
+  }
 }
 
 scd_40::scd_40(i2c_bus_controller *controller)
-    : i2c_peripheral(SCD40_I2C_ADDRESS, controller) {
-  /*
-  SCD40 will begin measurement as soon as voltage settles after power on,
-  this behaivor is undesirable. Stop measurement to prevent info readout block.
-  */
-  stop_measurement();
+    : i2c_peripheral(SCD40_I2C_ADDRESS, controller) {}
+
+bool scd_40::initialize(const bool low_power, const uint32_t now_ms,
+                        sequence_callback done) {
+  if (low_power)
+    return run(initialize_low_power_sequence, now_ms, done);
+
+  return run(initialize_sequence, now_ms, done);
 }
 
-bool scd_40::available() {
-  alloc_bytevect(pressure, SCD40_COMPENSATION_PRESSURE_SIZE);
-  if (!read(SCD40_COMPENSATION_PRESSURE, pressure))
+bool scd_40::restart(const bool low_power, const uint32_t now_ms,
+                     sequence_callback done) {
+  if (low_power)
+    return run(restart_low_power_sequence, now_ms, done);
+
+  return run(restart_sequence, now_ms, done);
+}
+
+bool scd_40::run(const command *sequence, const uint8_t length,
+                 const uint32_t now_ms, sequence_callback done) {
+  if (busy())
     return false;
 
-  return !scd_40_crc(pressure.begin(), 3);
+  m_sequence = sequence;
+  m_sequence_length = length;
+  m_sequence_step = 0;
+  m_sequence_done = done;
+
+  return advance(now_ms);
+}
+
+void scd_40::resume(const uint32_t now_ms) {
+  if (busy() && !advance(now_ms))
+    m_sequence_done.call_if(false);
 }
 
-bool scd_40::get_serial_number(uint64_t &sn) {
-  etl::vector<uint8_t, SCD40_GET_SERIAL_NO_RESP_SIZE> response(
-      SCD40_GET_SERIAL_NO_RESP_SIZE);
+/*
+Execute commands of the sequence one after another until one of them takes time
+to execute, then leave it to the scheduler to come back.
+*/
+bool scd_40::advance(const uint32_t now_ms) {
+  while (m_sequence_step < m_sequence_length) {
+    const command c = m_sequence[m_sequence_step++];
+
+    if (!execute(c, now_ms)) {
+      m_sequence = nullptr;
+      return false;
+    }
+
+    const uint16_t delay = execution_time_ms(c);
+    if (!delay)
+      continue;
+
+    // Next command would be ignored before this one is executed
+    if (!m_scheduler.is_valid() || !m_scheduler(delay)) {
+      m_sequence = nullptr;
+      return false;
+    }
+
+    return true;
+  }
+
+  m_sequence = nullptr;
+  m_sequence_done.call_if(true);
+  return true;
+}
 
-  if (!read(SCD40_GET_SERIAL_NO, response))
+bool scd_40::execute(const command c, const uint32_t now_ms) {
+  switch (c) {
+  case command::stop_measurement:
+    return stop_measurement();
+  case command::get_serial_number:
+    // Not fatal, serial_number() stays 0
+    m_serial_number = 0;
+    write<SCD40_GET_SERIAL_NO>();
+    return true;
+  case command::receive_serial_number:
+    receive_serial_number();
+    return true;
+  case command::start_measurement:
+    return start_measurement(now_ms);
+  case command::start_low_power_measurement:
+    return start_low_power_measurement(now_ms);
+  case command::set_ambient_pressure:
+    return send_compensation_pressure();
+  case command::get_ambient_pressure:
+    return write<SCD40_COMPENSATION_PRESSURE>() == i2c_status::ok;
+  case command::receive_ambient_pressure: {
+    uint8_t pressure[SCD40_COMPENSATION_PRESSURE_SIZE];
+    return receive(pressure, SCD40_COMPENSATION_PRESSURE_SIZE);
+  }
+  case command::get_data_ready_status:
+    return write<SCD40_MEASUREMENT_READY>() == i2c_status::ok;
+  case command::receive_data_ready_status:
+    return receive_data_ready_status();
+  case command::read_measurement:
+    return write<SCD40_GET_MEASUREMENT>() == i2c_status::ok;
+  default:
     return false;
+  }
+}
 
-  // Serial number has 3 16-bit words, each word is followed by 8 bits of CRC
-  uint8_t *iterator = response.begin();
-  for (uint8_t i = 0; i < SCD40_GET_SERIAL_NO_RESP_SIZE; i += 3)
+/**
+ * Read the response to the command executed last.
+ * @param[out] response buffer for 16-bit words, each followed by CRC.
+ * @param size response size, in bytes.
+ * @return true if the response has been read and its CRCs are valid.
+ */
+bool scd_40::receive(uint8_t *response, const uint8_t size) {
+  if (read(response, size) != i2c_status::ok)
+    return false;
+
+  for (uint8_t i = 0; i < size; i += 3)
     // if sequence contains valid CRC in the end, function will return 0
-    if (scd_40_crc(iterator + i, 3))
+    if (scd_40_crc(response + i, 3))
       return false;
 
+  return true;
+}
+
+bool scd_40::available(sequence_callback done) {
+  // No command of the sequence needs the time
+  return run(available_sequence, 0, done);
+}
+
+bool scd_40::discover() {
+  static const uint8_t addresses[] = {SCD40_I2C_ADDRESS};
+  return i2c_peripheral::discover(addresses);
+}
+
+void scd_40::receive_serial_number() {
+  uint8_t response[SCD40_GET_SERIAL_NO_RESP_SIZE];
+
+  if (!receive(response, SCD40_GET_SERIAL_NO_RESP_SIZE))
+    return;
+
+  // Serial number has 3 16-bit words, each word is followed by 8 bits of CRC
+  uint8_t *iterator = response;
   uint16_t word;
-  sn = 0;
+  uint64_t sn = 0;
   for (uint8_t i = 0; i < 3; ++i) {
     get_be(word, iterator);
     sn <<= 16;
@@ -91,71 +282,199 @@ bool scd_40::get_serial_number(uint64_t &sn) {
     ++iterator;
   }
 
+  m_serial_number = sn;
+}
+
+bool scd_40::send_compensation_pressure() {
+  uint8_t pressure[SCD40_COMPENSATION_PRESSURE_SIZE];
+  uint8_t *iterator = pressure;
+  set_be(m_pressure, iterator);
+  pressure[2] = scd_40_crc(pressure, 2);
+
+  if (write<SCD40_COMPENSATION_PRESSURE>(pressure) != i2c_status::ok)
+    return false;
+
+  m_pressure_pending = false;
+  m_stats.bytes += sizeof(uint16_t) + SCD40_COMPENSATION_PRESSURE_SIZE;
+  return true;
+}
+
+bool scd_40::start_measurement(const uint32_t now_ms) {
+  if (write<SCD40_START_MEASUREMENT>() != i2c_status::ok)
+    return false;
+
+  start_schedule(now_ms, SCD40_PERIOD_MS);
   return true;
 }
 
-bool scd_40::set_compensation_pressure(const uint16_t &hPa) {
-  alloc_bytevect(pressure, SCD40_COMPENSATION_PRESSURE_SIZE);
-  uint8_t *iterator = pressure.begin();
-  set_be(hPa, iterator);
-  pressure[2] = scd_40_crc(iterator - 2, 2);
+bool scd_40::start_low_power_measurement(const uint32_t now_ms) {
+  if (write<SCD40_START_LOW_POWER_MEASUREMENT>() != i2c_status::ok)
+    return false;
 
-  return write(SCD40_COMPENSATION_PRESSURE, pressure);
+  start_schedule(now_ms, SCD40_LOW_POWER_PERIOD_MS);
+  return true;
 }
 
-bool scd_40::start_measurement() {
-  etl::vector<uint8_t, 1> tmp;
-  return write(SCD40_START_MEASUREMENT, tmp);
+bool scd_40::low_power() const {
+  return m_period_ms == SCD40_LOW_POWER_PERIOD_MS;
 }
 
-bool scd_40::start_low_power_measurement() {
-  etl::vector<uint8_t, 1> tmp;
-  return write(SCD40_START_LOW_POWER_MEASUREMENT, tmp);
+void scd_40::start_schedule(const uint32_t now_ms, const uint16_t period_ms) {
+  m_period_ms = period_ms;
+  m_next_check_ms = now_ms + period_ms + SCD40_READOUT_MARGIN_MS;
+  m_polling = false;
+  m_probing = false;
+  m_on_time = 0;
 }
 
-bool scd_40::measurement_ready() {
-  alloc_bytevect(response, SCD40_MEASUREMENT_READY_RESP_SIZE);
+bool scd_40::check_sample(const uint32_t now_ms, sequence_callback done) {
+  m_sample_ready = false;
 
-  if (!read(SCD40_MEASUREMENT_READY, response))
+  if (!measuring() || !time_reached(now_ms, m_next_check_ms)) {
+    done.call_if(true);
+    return true;
+  }
+
+  if (busy())
     return false;
 
-  uint8_t *iterator = response.begin();
-  if (scd_40_crc(iterator, 3))
+  ++m_stats.checks;
+  m_check_ms = now_ms;
+  m_check_done = done;
+
+  const sequence_callback checked =
+      sequence_callback::create<scd_40, &scd_40::sample_checked>(*this);
+  const bool started = m_pressure_pending
+                           ? run(check_with_pressure_sequence, now_ms, checked)
+                           : run(check_sequence, now_ms, checked);
+  if (!started)
+    update_schedule(false);
+
+  return started;
+}
+
+void scd_40::sample_checked(const bool success) {
+  update_schedule(success);
+  m_check_done.call_if(success);
+}
+
+/**
+ * Move the next check according to what the last one has found.
+ * @param responded whether SCD40 has responded to the check.
+ */
+void scd_40::update_schedule(const bool responded) {
+  if (!m_sample_ready) {
+    // Too early, or no answer: poll until the sample shows up
+    if (responded && !m_polling)
+      ++m_stats.early_checks;
+
+    m_polling = true;
+    m_probing = false;
+    m_next_check_ms = m_check_ms + SCD40_POLL_MS;
+    return;
+  }
+
+  ++m_stats.samples;
+
+  if (m_polling) {
+    // The sample has been taken within the last poll interval
+    m_next_check_ms = m_check_ms + m_period_ms;
+    m_polling = false;
+    m_on_time = 0;
+  } else if (m_probing || ++m_on_time == SCD40_PROBE_PERIODS) {
+    // Check early, or even earlier if the early check wasn't early enough
+    m_next_check_ms += m_period_ms - SCD40_POLL_MS;
+    m_probing = true;
+    m_on_time = 0;
+  } else {
+    // Found on time: the schedule is right, keep it
+    m_next_check_ms += m_period_ms;
+  }
+}
+
+bool scd_40::receive_data_ready_status() {
+  uint8_t response[SCD40_MEASUREMENT_READY_RESP_SIZE];
+
+  if (!receive(response, SCD40_MEASUREMENT_READY_RESP_SIZE))
     return false;
 
-  uint16_t ready = 0;
-  get_be(ready, iterator);
+  m_stats.bytes += sizeof(uint16_t) + SCD40_MEASUREMENT_READY_RESP_SIZE;
+
+  uint8_t *iterator = response;
+  uint16_t status = 0;
+  get_be(status, iterator);
 
   // measurement is ready if any bit except the most significant is set
-  return ready & SCD40_MEASUREMENT_READY_MASK;
+  m_sample_ready = status & SCD40_MEASUREMENT_READY_MASK;
+  return true;
 }
 
 bool scd_40::stop_measurement() {
-  etl::vector<uint8_t, 1> tmp;
-  return write(SCD40_STOP_MEASUREMENT, tmp);
+  if (write<SCD40_STOP_MEASUREMENT>() != i2c_status::ok)
+    return false;
+
+  m_period_ms = 0;
+  return true;
 }
 
-bool scd_40::get_data(measurement_data &data) {
-  alloc_bytevect(response, SCD40_MEASUREMENT_RESP_SIZE);
-  if (!read(SCD40_GET_MEASUREMENT, response))
+bool scd_40::request_data(data_callback callback) {
+  // Previous readout is still in progress
+  if (m_transaction.status == i2c_status::queued ||
+      m_transaction.status == i2c_status::busy)
     return false;
 
-  uint8_t *iterator = response.begin();
+  m_data_callback = callback;
+
+  // No command of the sequence needs the time
+  return run(readout_sequence, 0,
+             sequence_callback::create<scd_40, &scd_40::measurement_executed>(
+                 *this));
+}
+
+void scd_40::measurement_executed(const bool success) {
+  if (success) {
+    m_segment = read_segment(m_response, SCD40_MEASUREMENT_RESP_SIZE);
+
+    m_transaction.segments = &m_segment;
+    m_transaction.segment_count = 1;
+    m_transaction.on_complete =
+        i2c_transaction::callback::create<scd_40, &scd_40::data_received>(
+            *this);
+
+    if (submit(m_transaction))
+      return;
+  }
+
+  m_data_callback.call_if(false, measurement_data{});
+}
+
+void scd_40::data_received(i2c_transaction &t) {
+  measurement_data data = {};
+  bool success = t.status == i2c_status::ok && parse_data(m_response, data);
+  if (t.status == i2c_status::ok)
+    m_stats.bytes += sizeof(uint16_t) + SCD40_MEASUREMENT_RESP_SIZE;
+
+  m_data_callback.call_if(success, data);
+}
+
+bool scd_40::parse_data(uint8_t *response, measurement_data &data) {
   for (uint8_t i = 0; i < SCD40_MEASUREMENT_RESP_SIZE; i += 3)
-    if (scd_40_crc(iterator + i, 3))
+    if (scd_40_crc(response + i, 3))
       return false;
 
+  uint8_t *iterator = response;
   get_be(data.co2ppm, iterator);
   ++iterator; // skip CRC byte
-  get_be(data.temperature, iterator);
-  ++iterator;
 
-  uint16_t temp;
-  get_be(temp, iterator);
+  uint16_t word;
+  get_be(word, iterator);
+  ++iterator;
 
   // CO2 ppm is usable as-is, temperature and humidity require some processing.
-  data.temperature = (-4500 + (data.temperature / 3.74f));
-  data.humidity = (temp / 655.35f);
+  data.temperature = scd_40_temperature(word);
+
+  get_be(word, iterator);
+  data.humidity = scd_40_humidity(word);
 
   return true;
 }
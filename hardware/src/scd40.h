@@ -10,72 +10,301 @@ SCD40 CO2 sensor driver, uses PlantMonitor I2C abstraction layer.
 
 #include "i2c.h"
 
+/*
+Time SCD40 needs to execute a command before it accepts the next one, see
+"Command overview" in the datasheet. It doesn't even acknowledge its address
+in the meantime, so the response of a read command is only read that long after
+the command, in a transaction of its own.
+*/
+#define SCD40_STOP_DELAY_MS 500
+#define SCD40_COMMAND_DELAY_MS 1
+
+/*
+SCD40 doesn't tell when its next sample is due, but it keeps a steady period
+from the start of the measurement. New data is checked for once that period
+has passed; if it isn't there yet, SCD40 is polled every SCD40_POLL_MS until it
+is, and the schedule is re-aligned to the sample just found. The margin makes
+the check come a bit after the sample. Samples found on time keep the schedule
+anchored where it is, one period after the previous check.
+
+That only catches SCD40 clock running slow: running fast, its samples are
+always found on time, just longer and longer after they are taken, until one
+of them is overwritten by the next. So every SCD40_PROBE_PERIODS samples the
+check comes SCD40_POLL_MS early. Normally it's too early and the schedule is
+re-aligned by polling; if the sample is there already, the next check comes
+another SCD40_POLL_MS earlier, until it's too early.
+*/
+#ifndef SCD40_READOUT_MARGIN_MS
+#define SCD40_READOUT_MARGIN_MS 50
+#endif
+
+#ifndef SCD40_POLL_MS
+#define SCD40_POLL_MS 100
+#endif
+
+#ifndef SCD40_PROBE_PERIODS
+#define SCD40_PROBE_PERIODS 10
+#endif
+
 class scd_40 : protected i2c_peripheral {
 
 public:
   struct measurement_data {
     // CO2 parts per million, as-is
     uint16_t co2ppm;
-    // Relative humidity, %
-    uint8_t humidity;
+    // Relative humidity / 100, %. I.e. 4512 = 45.12 %
+    uint16_t humidity;
     // Temperature / 100, C. I.e. 2346 = 23.46 C
     int16_t temperature;
   };
+
+  // Readout schedule activity since the last reset_schedule_stats()
+  struct schedule_stats {
+    // Checks for the new data, each one is a wakeup and a status read
+    uint16_t checks;
+    // Checks that came before the sample and switched to polling
+    uint16_t early_checks;
+    // Checks that found a new sample
+    uint16_t samples;
+    // Bytes transferred by successful checks and readouts
+    uint16_t bytes;
+  };
+
+  // Called with result of asynchronous readout, data is only valid on success
+  using data_callback =
+      etl::delegate<void(bool success, const measurement_data &data)>;
+
+  // Called once a command sequence is over
+  using sequence_callback = etl::delegate<void(bool success)>;
+
+  // Asks to call resume() in delay_ms, i.e. by a timer; false if it can't
+  using scheduler = etl::delegate<bool(uint16_t delay_ms)>;
+
   scd_40(i2c_bus_controller *);
 
   /**
-   * Perform connectivity check by querying SCD40 for compensation pressure and
-   * accepting any valid response.
-   * @return true if SCD40 is available for requests over I2C bus.
+   * Set the way command sequences wait for SCD40 to execute a command, must be
+   * set before anything is asked from SCD40, i.e. initialize(): without it, a
+   * sequence fails at the first command that takes time to execute, and every
+   * read command does.
+   * @param s called whenever a sequence has to wait. The sequence fails if it
+   * returns false.
+   */
+  void set_scheduler(scheduler s) { m_scheduler = s; }
+
+  /**
+   * Get SCD40 ready and start measurement without waiting: stop measurement
+   * it might be running since power on, read serial number, which it only
+   * gives out when idle, then start periodic measurement. Commands are spaced
+   * by their execution times through the scheduler, see resume().
+   * @param low_power start low power periodic measurement if true.
+   * @param now_ms current time, milliseconds.
+   * @param done called with the outcome once measurement is started, unless
+   * the sequence fails right away.
+   * @return false if SCD40 has failed the first command, or another sequence
+   * is in progress.
+   */
+  bool initialize(const bool low_power, const uint32_t now_ms,
+                  sequence_callback done);
+
+  /**
+   * Switch to another measurement mode without waiting: stop measurement,
+   * then start it again, see initialize().
+   */
+  bool restart(const bool low_power, const uint32_t now_ms,
+               sequence_callback done);
+
+  /**
+   * Carry on with the command sequence once the scheduler's delay is over.
+   * @param now_ms current time, milliseconds.
+   */
+  void resume(const uint32_t now_ms);
+
+  /**
+   * @return true while a command sequence is in progress: no other commands
+   * should be sent.
+   */
+  bool busy() const { return m_sequence != nullptr; }
+
+  /**
+   * @return serial number read by the last initialize(), 0 if it has failed.
+   */
+  uint64_t serial_number() const { return m_serial_number; }
+
+  // Address the driver is bound to, see discover()
+  using i2c_peripheral::bus_address;
+
+  /**
+   * Probe SCD40 address on the bus.
+   * @return true if SCD40 has been found.
    */
-  bool available();
+  bool discover();
 
   /**
-   * Query SCD40 serial number and waiting for any valid response.
-   * NOTE: serial number cannot be read while sensor is performing measurement.
-   * @param[out] serial_number output of the command.
-   * @return true if serial number is successfuly fetched.
+   * Perform connectivity check by querying SCD40 for compensation pressure and
+   * accepting any valid response. The response is read through the scheduler,
+   * see resume().
+   * @param done called with the outcome once the response is read, unless the
+   * query fails right away.
+   * @return false if SCD40 has failed the query, or another sequence is in
+   * progress.
    */
-  bool get_serial_number(uint64_t &serial_number);
+  bool available(sequence_callback done);
 
   /**
-   * Set compensation pressure to make measurement more precise.
+   * Set compensation pressure to make measurement more precise. It's sent to
+   * SCD40 along with the next check for new data, see check_sample().
    * NOTE: quite inaccurate, regular measurement is preferable.
-   * @return true if new pressure has been succesfuly sent to SCD40
    */
-  bool set_compensation_pressure(const uint16_t &hPa);
+  void set_compensation_pressure(const uint16_t &hPa) {
+    m_pressure = hPa;
+    m_pressure_pending = true;
+  }
 
   /**
    * Start standard periodic measurement. New result will be available every 5
    * seconds. NOTE: this command will fail if sensor is already performing
    * measurement.
+   * @param now_ms current time, milliseconds: the readout schedule starts
+   * from it.
    * @return true if measurement has started
    */
-  bool start_measurement();
+  bool start_measurement(const uint32_t now_ms);
 
   /**
    * Start low power periodic measurement. New result will be available every 30
    * seconds. NOTE: this command will fail if sensor is already performing
    * measurement.
+   * @param now_ms current time, milliseconds: the readout schedule starts
+   * from it.
    * @return true if measurement has started
    */
-  bool start_low_power_measurement();
+  bool start_low_power_measurement(const uint32_t now_ms);
+
+  /**
+   * @return true if periodic measurement has been started by this driver.
+   */
+  bool measuring() const { return m_period_ms != 0; }
+
+  /**
+   * @return true if low power periodic measurement is running.
+   */
+  bool low_power() const;
+
+  /**
+   * Get the time to check for the new data at: when the next sample is
+   * expected, or the next poll if the last check came too early.
+   * Only meaningful while measuring().
+   * @return time in milliseconds, same clock as passed to sample_ready().
+   */
+  uint32_t next_check_ms() const { return m_next_check_ms; }
 
   /**
-   * Check for the new data.
-   * @return true if SCD40 has measurement data to send
+   * Check for the new data if it's time to, see next_check_ms(), and keep the
+   * schedule aligned with the samples of SCD40. The status is read through the
+   * scheduler, see resume().
+   * @param now_ms current time, milliseconds.
+   * @param done called once the check is over, see sample_ready(): with false
+   * if SCD40 didn't respond, right away if it isn't time yet.
+   * @return false if SCD40 has failed the check right away, or another
+   * sequence is in progress.
    */
-  bool measurement_ready();
+  bool check_sample(const uint32_t now_ms, sequence_callback done);
 
   /**
-   * Stop current standard/low power periodic measurement.
+   * @return true if the last check_sample() has found new data to read.
+   */
+  bool sample_ready() const { return m_sample_ready; }
+
+  const schedule_stats &get_schedule_stats() const { return m_stats; }
+  void reset_schedule_stats() { m_stats = {}; }
+
+  /**
+   * Stop current standard/low power periodic measurement. SCD40 doesn't
+   * respond for SCD40_STOP_DELAY_MS after that, to finish the measurement.
    * @return true if SCD40 has stopped periodic measurement.
    */
   bool stop_measurement();
 
   /**
-   * Get measurement data.
-   * @param [out] data data to write result to.
+   * Get measurement data in background: the command is followed by the read
+   * through the scheduler, see resume(), and the read is queued with
+   * i2c_bus_controller::submit().
+   * @param callback function to call from the main loop with the result.
+   * @return true if readout has been started, false if SCD40 has failed the
+   * command, or previous readout or another sequence is still in progress.
    */
-  bool get_data(measurement_data &data);
+  bool request_data(data_callback callback);
+
+  // Single command of a sequence
+  enum class command : uint8_t {
+    stop_measurement,
+    get_serial_number,
+    start_measurement,
+    start_low_power_measurement,
+    set_ambient_pressure,
+    get_ambient_pressure,
+    get_data_ready_status,
+    read_measurement,
+    // Reads of the response, once the command before is executed
+    receive_serial_number,
+    receive_ambient_pressure,
+    receive_data_ready_status
+  };
+
+private:
+  template <uint8_t N>
+  bool run(const command (&sequence)[N], const uint32_t now_ms,
+           sequence_callback done) {
+    return run(sequence, N, now_ms, done);
+  }
+
+  bool run(const command *sequence, const uint8_t length,
+           const uint32_t now_ms, sequence_callback done);
+  bool advance(const uint32_t now_ms);
+  bool execute(const command c, const uint32_t now_ms);
+
+  bool receive(uint8_t *response, const uint8_t size);
+  void receive_serial_number();
+  bool receive_data_ready_status();
+  bool send_compensation_pressure();
+
+  void sample_checked(const bool success);
+  void update_schedule(const bool responded);
+  void measurement_executed(const bool success);
+  void data_received(i2c_transaction &t);
+  static bool parse_data(uint8_t *response, measurement_data &data);
+  void start_schedule(const uint32_t now_ms, const uint16_t period_ms);
+
+  i2c_segment m_segment;
+  i2c_transaction m_transaction;
+  uint8_t m_response[9]; // 3 words, each followed by CRC
+  data_callback m_data_callback;
+
+  // Sampling period of the running measurement, 0 if it's stopped
+  uint16_t m_period_ms = 0;
+  uint32_t m_next_check_ms = 0;
+  bool m_polling = false;
+  // The check is early on purpose, to see if SCD40 clock is running fast
+  bool m_probing = false;
+  // Samples found on time since the last early check
+  uint8_t m_on_time = 0;
+  schedule_stats m_stats = {};
+
+  // Check for the new data in progress, see check_sample()
+  uint32_t m_check_ms = 0;
+  sequence_callback m_check_done;
+  bool m_sample_ready = false;
+
+  // Compensation pressure to send with the next check
+  uint16_t m_pressure = 0;
+  bool m_pressure_pending = false;
+
+  // Command sequence in progress, nullptr if there is none
+  const command *m_sequence = nullptr;
+  uint8_t m_sequence_length = 0;
+  uint8_t m_sequence_step = 0;
+  sequence_callback m_sequence_done;
+  scheduler m_scheduler;
+  uint64_t m_serial_number = 0;
 };
@@ -1,8 +1,10 @@
 #include <avr/interrupt.h>
-#include <etl/algorithm.h>
 #include <etl/list.h>
 #include <etl/pool.h>
+#include <util/atomic.h>
 
+#include "deadline.h"
+#include "events.h"
 #include "timers.h"
 
 /*
@@ -11,26 +13,55 @@ https://ww1.microchip.com/downloads/en/DeviceDoc/Atmel-7810-Automotive-Microcont
 */
 
 /*
-Together with prescaler value of 256, Timer 1 compare match A interrupt will
-be triggered once a second, i.e. F_CPU / 256 / 62500 = 1;
-where F_CPU usually equals to 16MHz for 5v Arduino Nano board with Atmega328p.
+Timer 1 is never stopped or reset, it's the source of monotonic time. With
+prescaler value of 64, TCNT1 is incremented every 4 microseconds, i.e.
+64 / F_CPU, where F_CPU usually equals to 16MHz for 5v Arduino Nano board with
+Atmega328p. The 16-bit counter overflows every 65536 * 4 = 262144 microseconds,
+overflow interrupt extends it to 32 bits.
 */
-#define OCR1A_CYCLES_FOR_ONE_SECOND (uint16_t)(F_CPU / 256)
+#define TIMER1_MICROSECONDS_PER_TICK 4
+#define TIMER1_TICKS_PER_MILLISECOND (1000 / TIMER1_MICROSECONDS_PER_TICK)
+#define TIMER1_OVERFLOW_MILLISECONDS 262
+#define TIMER1_OVERFLOW_MICROSECONDS_REMAINDER 144
 
 /*
-Same logic applies for 1 millisecond
+Furthest deadline the output compare register can be programmed for, counting
+from TCNT1: anything beyond that is rechecked on the next counter overflow.
 */
-#define OCR1B_CYCLES_FOR_ONE_MILLISECOND (uint16_t)(1 / 1000 * F_CPU / 256 + 1)
+#define TIMER1_MAX_COMPARE_MILLISECONDS                                        \
+  (UINT16_MAX / TIMER1_TICKS_PER_MILLISECOND)
 
+/*
+Shortest alarm in ticks: the compare register must be ahead of TCNT1 by the
+time it's written, or the alarm comes a whole counter period late.
+*/
+#define TIMER1_MIN_ALARM_TICKS 16
+
+/*
+Tickless scheduling: timers are kept in a single queue sorted by deadline, and
+output compare A interrupt is only programmed for the earliest of them. Unless
+there is something due, the CPU is only interrupted by counter overflows, less
+than 4 times a second.
+*/
 struct timer_manager_instance::impl {
   using timer_list = etl::list_ext<callback_timer>;
+
   etl::pool<timer_list::pool_type, PLANT_MONITOR_MAX_TIMERS> m_pool;
-  timer_list m_seconds_timers;
-  timer_list m_milliseconds_timers;
+  // Only ever touched by the main loop
+  timer_list m_timers;
+  // Whether m_timers is non-empty, for the overflow interrupt to look at
+  volatile bool m_pending = false;
+
+  // Called back by output compare B, see set_alarm()
+  callback m_alarm;
+
+  // Monotonic clock, extended by the overflow interrupt
+  volatile uint16_t m_overflows = 0;
+  volatile uint32_t m_overflow_ms = 0;
+  volatile uint16_t m_overflow_us = 0;
 
   impl() {
-    m_seconds_timers.set_pool(m_pool);
-    m_milliseconds_timers.set_pool(m_pool);
+    m_timers.set_pool(m_pool);
 
     cli(); // stop interrupts
 
@@ -38,144 +69,257 @@ struct timer_manager_instance::impl {
     TCCR1B = 0; // Clear TCCR1B register
     TCNT1 = 0;  // Reset Timer CouNTer 1
 
-    /*
-    Adjust Timer 1 Control register B to set the prescaler to F_CPU/256.
-    With F_CPU == 16MHz, this means, that every 16 microseconds value of TCNT1
-    will be incremented by 1.
-    */
-    TCCR1B |= (1 << CS12);
+    // Adjust Timer 1 Control register B to set the prescaler to F_CPU/64.
+    TCCR1B |= (1 << CS11) | (1 << CS10);
+
+    // Enable timer 1 overflow interrupt
+    TIMSK1 |= _BV(TOIE1);
 
     sei(); // allow interrupts
   }
 
-  void enable_seconds_interrupt(bool enable) {
-    if (enable) {
-      /*
-      The "Output Compare Register (Timer) 1 A" is used to trigger interrupt
-      whenever OCR1A == TCNT1.
-      */
-      OCR1A = TCNT1 + OCR1A_CYCLES_FOR_ONE_SECOND;
+  /**
+   * Read the counter together with its overflow count. Must be called with
+   * interrupts disabled.
+   * @param[out] ticks TCNT1 value
+   * @return overflow count matching @p ticks
+   */
+  uint16_t read_counter(uint16_t &ticks) {
+    uint16_t overflows = m_overflows;
+    ticks = TCNT1;
+
+    // Counter has just overflown, but the interrupt is yet to run.
+    if ((TIFR1 & _BV(TOV1)) && ticks < 0x8000)
+      ++overflows;
+
+    return overflows;
+  }
 
-      // Enable timer 1 output compare A match interrupt.
-      TIMSK1 |= _BV(OCIE1A);
-    } else {
-      // Disable timer 1 output compare A match interrupt.
-      TIMSK1 &= ~_BV(OCIE1A);
+  uint32_t now_us() {
+    uint16_t overflows = 0;
+    uint16_t ticks = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { overflows = read_counter(ticks); }
+
+    return (static_cast<uint32_t>(overflows) << 18) |
+           (static_cast<uint32_t>(ticks) * TIMER1_MICROSECONDS_PER_TICK);
+  }
+
+  uint32_t now_ms() {
+    uint32_t ms = 0;
+    uint32_t us = 0;
+    uint16_t ticks = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ms = m_overflow_ms;
+      us = m_overflow_us;
+
+      if (read_counter(ticks) != m_overflows) {
+        ms += TIMER1_OVERFLOW_MILLISECONDS;
+        us += TIMER1_OVERFLOW_MICROSECONDS_REMAINDER;
+      }
+    }
+
+    return ms + (us + static_cast<uint32_t>(ticks) *
+                          TIMER1_MICROSECONDS_PER_TICK) /
+                    1000;
+  }
+
+  void overflow_tick() {
+    m_overflows = m_overflows + 1;
+
+    uint16_t us = m_overflow_us + TIMER1_OVERFLOW_MICROSECONDS_REMAINDER;
+    uint32_t ms = m_overflow_ms + TIMER1_OVERFLOW_MILLISECONDS;
+    if (us >= 1000) {
+      us -= 1000;
+      ++ms;
     }
+
+    m_overflow_us = us;
+    m_overflow_ms = ms;
+
+    // Far deadlines might just got close enough to program the compare unit.
+    if (m_pending && !(TIMSK1 & _BV(OCIE1A)))
+      event_queue::post(ev_timers_due);
+  }
+
+  void deadline_tick() {
+    TIMSK1 &= ~_BV(OCIE1A);
+    event_queue::post(ev_timers_due);
   }
 
-  bool seconds_interrupt_enabled() { return TIMSK1 & _BV(OCIE1A); }
+  void set_alarm(const uint32_t timeout_us, callback c) {
+    uint32_t ticks = timeout_us / TIMER1_MICROSECONDS_PER_TICK;
+    if (ticks < TIMER1_MIN_ALARM_TICKS)
+      ticks = TIMER1_MIN_ALARM_TICKS;
+    else if (ticks > UINT16_MAX)
+      ticks = UINT16_MAX;
 
-  void enable_milliseconds_interrupt(bool enable) {
-    if (enable) {
-      // Enable timer 1 output compare B match interrupt
-      OCR1B = TCNT1 + OCR1B_CYCLES_FOR_ONE_MILLISECOND;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      m_alarm = c;
+      OCR1B = TCNT1 + static_cast<uint16_t>(ticks);
+
+      // Clear stale compare match flag by writing one to it.
+      TIFR1 = _BV(OCF1B);
       TIMSK1 |= _BV(OCIE1B);
-    } else {
-      TIMSK1 &= ~_BV(OCIE1B);
     }
   }
 
-  bool milliseconds_interrupt_enabled() { return TIMSK1 & _BV(OCIE1B); }
+  void cancel_alarm() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { TIMSK1 &= ~_BV(OCIE1B); }
+  }
+
+  void alarm_tick() {
+    TIMSK1 &= ~_BV(OCIE1B);
+    m_alarm.call_if();
+  }
+
+  /**
+   * Put a timer to its place in the queue.
+   * @param t timer to insert, its deadline must be set.
+   */
+  void insert(const callback_timer &t) {
+    auto iterator = m_timers.begin();
+
+    while (iterator != m_timers.end() &&
+           time_reached(t.deadline, iterator->deadline))
+      ++iterator;
+
+    m_timers.insert(iterator, t);
+  }
+
+  /**
+   * Program output compare A for the queue head, if it's close enough.
+   * @param now current now_ms() value
+   */
+  void schedule(uint32_t now) {
+    // The alarm is armed from interrupts, TIMSK1 is shared with them
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { TIMSK1 &= ~_BV(OCIE1A); }
+
+    // Single byte store, the interrupt sees either value as a whole
+    m_pending = !m_timers.empty();
+    if (!m_pending)
+      return;
+
+    int32_t remaining = static_cast<int32_t>(m_timers.front().deadline - now);
+
+    if (remaining <= 0) {
+      event_queue::post(ev_timers_due);
+      return;
+    }
+
+    // Overflow interrupt will get back to it later.
+    if (remaining > TIMER1_MAX_COMPARE_MILLISECONDS)
+      return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      OCR1A = TCNT1 + static_cast<uint16_t>(remaining) *
+                          TIMER1_TICKS_PER_MILLISECOND;
+
+      // Clear stale compare match flag by writing one to it.
+      TIFR1 = _BV(OCF1A);
+      TIMSK1 |= _BV(OCIE1A);
+    }
+  }
+
+  bool add(callback_timer &t, uint32_t timeout_ms) {
+    uint32_t now = now_ms();
+    t.timeout = timeout_ms;
+    t.deadline = now + timeout_ms;
+    insert(t);
+    schedule(now);
+
+    return true;
+  }
 
-  void second_tick() {
-    OCR1A = TCNT1 + OCR1A_CYCLES_FOR_ONE_SECOND;
-    for (auto &t : m_seconds_timers)
-      ++t.ticks;
+  void remove(const uint8_t id) {
+    for (auto iterator = m_timers.begin(); iterator != m_timers.end();
+         ++iterator) {
+      if (iterator->id == id) {
+        m_timers.erase(iterator);
+        m_pending = !m_timers.empty();
+        return;
+      }
+    }
   }
 
-  void millisecond_tick() {
-    OCR1B = TCNT1 + OCR1B_CYCLES_FOR_ONE_MILLISECOND;
-    for (auto &t : m_milliseconds_timers)
-      ++t.ticks;
+  void process() {
+    uint32_t now = now_ms();
+
+    while (!m_timers.empty() && time_reached(now, m_timers.front().deadline)) {
+      /*
+      Take the timer out of the queue before calling back, callback is free
+      to add or remove timers, including this one.
+      */
+      callback_timer expired = m_timers.front();
+      m_timers.pop_front();
+
+      if (expired.repeating) {
+        // Count from the deadline, not from now, so periodic timers don't drift
+        expired.deadline += expired.timeout;
+        insert(expired);
+      }
+
+      expired.callback();
+    }
+
+    schedule(now_ms());
   }
 };
 
 timer_manager_instance::timer_manager_instance() : m_impl(new impl) {}
 
 bool timer_manager_instance::add_seconds_timer(callback_timer &&t) {
+  // It would be due again as soon as it's called back, forever
+  if (t.repeating && !t.timeout)
+    return false;
+
   remove_timer(t.id);
 
   if (m_impl->m_pool.full())
     return false;
 
-  m_impl->m_seconds_timers.emplace_back(t);
-
-  if (!m_impl->seconds_interrupt_enabled())
-    m_impl->enable_seconds_interrupt(true);
-
-  return true;
+  return m_impl->add(t, t.timeout * 1000);
 }
 
 bool timer_manager_instance::add_milliseconds_timer(callback_timer &&t) {
+  // It would be due again as soon as it's called back, forever
+  if (t.repeating && !t.timeout)
+    return false;
+
   remove_timer(t.id);
 
   if (m_impl->m_pool.full())
     return false;
 
-  m_impl->m_milliseconds_timers.emplace_back(t);
-
-  if (!m_impl->milliseconds_interrupt_enabled())
-    m_impl->enable_milliseconds_interrupt(true);
-
-  return true;
+  return m_impl->add(t, t.timeout);
 }
 
 void timer_manager_instance::remove_timer(const uint8_t timer_id) {
-  auto remove_by_id = [timer_id](const callback_timer &t) {
-    return t.id == timer_id;
-  };
+  m_impl->remove(timer_id);
+}
 
-  m_impl->m_seconds_timers.remove_if(remove_by_id);
-  m_impl->m_milliseconds_timers.remove_if(remove_by_id);
+void timer_manager_instance::process_callbacks() { m_impl->process(); }
 
-  if (m_impl->m_seconds_timers.empty())
-    m_impl->enable_seconds_interrupt(false);
+uint32_t timer_manager_instance::now_us() { return m_impl->now_us(); }
 
-  if (m_impl->m_milliseconds_timers.empty())
-    m_impl->enable_milliseconds_interrupt(false);
-}
+uint32_t timer_manager_instance::now_ms() { return m_impl->now_ms(); }
 
-void timer_manager_instance::process_callbacks() {
-  auto callback_processor = [](auto &container) {
-    auto iterator = container.begin();
-    auto end = container.end();
-
-    // For some reason, clang-format can't handle this. Disable for this loop.
-    // clang-format off
-    while (iterator != end) {
-      if (iterator->expired()) {
-      	iterator->callback();
-
-      	if (iterator->repeating) {
-      	  iterator->ticks = 0;
-      	  ++iterator;
-      	} else {
-      	  iterator = container.erase(iterator);
-				}
-      } else {
-        ++iterator;
-      }
-    }
-    // clang-format on
-  };
+void timer_manager_instance::set_alarm(const uint32_t timeout_us,
+                                       callback c) {
+  m_impl->set_alarm(timeout_us, c);
+}
 
-  callback_processor(m_impl->m_milliseconds_timers);
-  callback_processor(m_impl->m_seconds_timers);
+void timer_manager_instance::cancel_alarm() { m_impl->cancel_alarm(); }
 
-  if (m_impl->m_seconds_timers.empty())
-    m_impl->enable_seconds_interrupt(false);
+void timer_manager_instance::overflow_interrupt() { m_impl->overflow_tick(); }
 
-  if (m_impl->m_milliseconds_timers.empty())
-    m_impl->enable_milliseconds_interrupt(false);
-}
+void timer_manager_instance::deadline_interrupt() { m_impl->deadline_tick(); }
 
-void timer_manager_instance::seconds_interrupt() { m_impl->second_tick(); }
+void timer_manager_instance::alarm_interrupt() { m_impl->alarm_tick(); }
 
-void timer_manager_instance::milliseconds_interrupt() {
-  m_impl->millisecond_tick();
-}
+ISR(TIMER1_OVF_vect) { timer_manager::instance().overflow_interrupt(); }
 
-ISR(TIMER1_COMPA_vect) { timer_manager::instance().seconds_interrupt(); }
+ISR(TIMER1_COMPA_vect) { timer_manager::instance().deadline_interrupt(); }
 
-ISR(TIMER1_COMPB_vect) { timer_manager::instance().milliseconds_interrupt(); }
+ISR(TIMER1_COMPB_vect) { timer_manager::instance().alarm_interrupt(); }
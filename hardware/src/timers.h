@@ -12,7 +12,12 @@
 #define PLANT_MONITOR_MAX_TIMERS 8
 #endif
 
-enum timer_ids : uint8_t { usart_line_idle, one_second };
+enum timer_ids : uint8_t {
+  one_second,
+  scd40_readout,
+  scd40_sequence,
+  hourly_report
+};
 
 class timer_manager_instance {
   struct impl;
@@ -26,19 +31,76 @@ public:
   struct callback_timer {
     bool repeating = true;
     uint8_t id; // deliberately not set, possible randomness kinda favors it
-    uint32_t ticks = 0;
+    // Managed by timer_manager: now_ms() value to expire at.
+    uint32_t deadline = 0;
+    // Set by the caller in timer units, converted to milliseconds once added.
     uint32_t timeout = 0;
     timer_manager_instance::callback callback;
-    bool expired() { return ticks >= timeout; }
   };
 
+  /**
+   * Add a timer counting seconds. Timer with the same id is replaced.
+   * @param t timer to add, fires every @p t.timeout seconds if repeating,
+   * once otherwise.
+   * @return true if the timer has been added, false if there is no room for
+   * it or it's repeating with zero timeout.
+   */
   bool add_seconds_timer(callback_timer &&t);
+
+  /**
+   * Add a timer counting milliseconds. Timer with the same id is replaced.
+   * @param t timer to add, fires every @p t.timeout milliseconds if repeating,
+   * once otherwise.
+   * @return true if the timer has been added, false if there is no room for
+   * it or it's repeating with zero timeout.
+   */
   bool add_milliseconds_timer(callback_timer &&t);
+
+  /**
+   * Remove a timer, if there is one.
+   * @param id timer id.
+   */
   void remove_timer(const uint8_t id);
+
+  /**
+   * Call back expired timers. Only visits timers that are due, call it from the
+   * main loop on every ev_timers_due event.
+   */
   void process_callbacks();
 
-  void seconds_interrupt();
-  void milliseconds_interrupt();
+  /**
+   * Get monotonic time since timer_manager creation. Wraps around every
+   * 71.5 minutes.
+   * @return time in microseconds, with resolution of 4 microseconds.
+   */
+  uint32_t now_us();
+
+  /**
+   * Get monotonic time since timer_manager creation. Wraps around every
+   * 49.7 days.
+   * @return time in milliseconds.
+   */
+  uint32_t now_ms();
+
+  /**
+   * Arm the alarm: a single deadline, precise to a few microseconds, which
+   * calls back straight from the interrupt. Meant to bound hardware operations,
+   * such as I2C transactions. Arming it again replaces the previous deadline.
+   * Safe to call from interrupts.
+   * @param timeout_us time until the deadline, up to 262 ms.
+   * @param c called from the interrupt once the deadline has passed, keep it
+   * short.
+   */
+  void set_alarm(const uint32_t timeout_us, callback c);
+
+  /**
+   * Disarm the alarm, if it's armed. Safe to call from interrupts.
+   */
+  void cancel_alarm();
+
+  void overflow_interrupt();
+  void deadline_interrupt();
+  void alarm_interrupt();
 };
 
 using timer_manager = etl::singleton<timer_manager_instance>;
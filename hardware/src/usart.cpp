@@ -1,17 +1,16 @@
 #include <avr/interrupt.h>
 #include <limits.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
+#include <util/atomic.h>
 
+#include "convert_util.h"
 #include "proto.h"
+#include "timers.h"
 #include "usart.h"
 
 #define __PLANT_MESSAGE_STRUCT
 #include "plant_message_struct.h"
 
-#include "timers.h"
-
 /*
 Refer to Atmega328p datasheet, section 19:
 https://ww1.microchip.com/downloads/en/DeviceDoc/Atmel-7810-Automotive-Microcontrollers-ATmega328P_Datasheet.pdf
@@ -76,17 +75,73 @@ bool usart::set_baudrate(uint32_t baudrate) {
 }
 #endif
 
-// Dump all received bytes here
-volatile uint8_t rxBuffer[USART_BUFFER_SIZE] = {};
+static_assert((USART_TX_QUEUE_SIZE & (USART_TX_QUEUE_SIZE - 1)) == 0,
+              "USART_TX_QUEUE_SIZE must be a power of two");
+static_assert(USART_TX_QUEUE_SIZE <= 128,
+              "Queue indices must be able to tell full queue from empty one");
+static_assert(USART_TX_QUEUE_SIZE >= PMC_MAX_MSG_LENGTH,
+              "Transmit queue can't fit the longest message");
+
+#define USART_TX_QUEUE_MASK (USART_TX_QUEUE_SIZE - 1)
+
+/*
+Single producer, single consumer transmit queue. The main loop appends whole
+serialized messages at txHead, data register empty interrupt sends bytes from
+txTail and disables itself once the queue is drained.
+*/
+static uint8_t txQueue[USART_TX_QUEUE_SIZE] = {};
+static volatile uint8_t txHead = 0;
+static volatile uint8_t txTail = 0;
+// Free space pmUSARTReserve() waits for, 0 if none.
+static volatile uint8_t txWanted = 0;
+
+static_assert((USART_LOG_QUEUE_SIZE & (USART_LOG_QUEUE_SIZE - 1)) == 0,
+              "USART_LOG_QUEUE_SIZE must be a power of two");
+static_assert(USART_LOG_QUEUE_SIZE <= 256, "Log queue indices are single byte");
+
+#define USART_LOG_QUEUE_MASK (USART_LOG_QUEUE_SIZE - 1)
+
+/*
+Log queue works just like the transmit queue, except one byte is always kept
+free to tell full queue from empty one, that's what allows it to be 256 bytes
+long with single byte indices.
+*/
+static uint8_t logQueue[USART_LOG_QUEUE_SIZE] = {};
+static volatile uint8_t logHead = 0;
+static volatile uint8_t logTail = 0;
+static pmLogLevel logLevel = plInfo;
+static pmUSARTLogStats logStats = {};
 
-// Put all data to be sent here
-volatile uint8_t txBuffer[USART_BUFFER_SIZE] = {};
+static_assert((USART_RX_QUEUE_SIZE & (USART_RX_QUEUE_SIZE - 1)) == 0,
+              "USART_RX_QUEUE_SIZE must be a power of two");
 
-static volatile uint8_t bytesReceived = 0;
-static volatile uint8_t bytesToSend = 0;
-static volatile uint8_t bytesSent = 0;
+#define USART_RX_QUEUE_MASK (USART_RX_QUEUE_SIZE - 1)
 
-void (*pmUSARTLineIdleCallback)(void) = nullptr;
+/*
+Single producer, single consumer receive queue. The receive interrupt parses
+incoming bytes straight into rxQueue[rxHead] and publishes the slot by moving
+rxHead forward once the message is complete; the main loop reads
+rxQueue[rxTail] in place and frees the slot by moving rxTail forward. Each
+index is written by one side only and is a single byte, so no locking is
+required.
+*/
+static pmParser rxParser = {};
+static plantMessage rxQueue[USART_RX_QUEUE_SIZE] = {};
+static pmParseResult rxResults[USART_RX_QUEUE_SIZE] = {};
+static volatile uint8_t rxHead = 0;
+static volatile uint8_t rxTail = 0;
+static volatile pmUSARTRxStats rxStats = {};
+static uint32_t rxLastByteUs = 0;
+
+// Keep the compiler from moving memory accesses across queue index updates.
+#define USART_MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+void (*pmUSARTMessageReceivedCallback)(void) = nullptr;
+void (*pmUSARTSendReadyCallback)(void) = nullptr;
+
+static uint8_t txSpace(uint8_t head, uint8_t tail) {
+  return USART_TX_QUEUE_SIZE - static_cast<uint8_t>(head - tail);
+}
 
 void pmUSARTInit() {
   /*
@@ -107,81 +162,248 @@ void pmUSARTInit() {
   /*
   Using USART 0 Control and Status Register 0 B (U C S R 0 B), enable:
     - Recieve Complete Interrupt 0 (RX C I E 0)
-    - Transmit Complete Interrupt 0 (TX C I E 0)
     - USART 0 Transmitter (TX EN 0)
     - USART 0 Receiver (RX EN 0)
+  USART Data Register Empty Interrupt (U D R I E 0) is only enabled while there
+  is something to send.
   */
-  UCSR0B |= (1 << RXCIE0) | (1 << TXCIE0) | (1 << TXEN0) | (1 << RXEN0);
+  UCSR0B |= (1 << RXCIE0) | (1 << TXEN0) | (1 << RXEN0);
+}
+
+bool pmUSARTSend(const plantMessage *message) {
+  uint8_t buffer[PMC_MAX_MSG_LENGTH];
+  uint8_t size = sizeof(buffer);
+
+  if (!pmSerialize(message, buffer, &size))
+    return false;
+
+  uint8_t head = txHead;
+  if (size > txSpace(head, txTail))
+    return false;
+
+  for (uint8_t i = 0; i < size; ++i, ++head)
+    txQueue[head & USART_TX_QUEUE_MASK] = buffer[i];
+
+  USART_MEMORY_BARRIER();
+  txHead = head;
+
+  // Interrupt will fire right away if the data register is already empty.
+  UCSR0B |= (1 << UDRIE0);
+
+  return true;
 }
 
-void pmUSARTSend(const plantMessage *message) {
-  bytesToSend = USART_BUFFER_SIZE;
-  pmSerialize(message, (uint8_t *)txBuffer, (uint8_t *)&bytesToSend);
+bool pmUSARTReserve(uint8_t size) {
+  // Ask before checking: the interrupt may free the space in between.
+  txWanted = size;
+  USART_MEMORY_BARRIER();
 
-  // Send the first byte straight away. The rest of them will be sent in TX ISR
-  UDR0 = txBuffer[0];
-  bytesSent = 1;
+  if (size > txSpace(txHead, txTail))
+    return false;
+
+  txWanted = 0;
+  return true;
 }
 
-uint8_t pmUSARTCopyReceivedData(uint8_t **buffer) {
-  if (!bytesReceived)
-    return 0;
+pmParseResult pmUSARTPeek(const plantMessage **message) {
+  uint8_t tail = rxTail;
+  if (tail == rxHead)
+    return prUndefined;
+
+  USART_MEMORY_BARRIER();
+
+  *message = &rxQueue[tail & USART_RX_QUEUE_MASK];
+  return rxResults[tail & USART_RX_QUEUE_MASK];
+}
 
-  *buffer = static_cast<uint8_t *>(malloc(bytesReceived));
-  memcpy(*buffer, (const uint8_t *)rxBuffer, bytesReceived);
+void pmUSARTConsume() {
+  if (rxTail == rxHead)
+    return;
 
-  return bytesReceived;
+  USART_MEMORY_BARRIER();
+  rxTail = rxTail + 1;
 }
 
-void pmUSARTClearRxBuffer() { bytesReceived = 0; }
+void pmUSARTGetRxStats(pmUSARTRxStats *stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    stats->messagesDropped = rxStats.messagesDropped;
+    stats->hardwareOverruns = rxStats.hardwareOverruns;
+    stats->messagesTruncated = rxStats.messagesTruncated;
+  }
+}
 
-// Succesfully received one frame - stash it, or, if buffer is full, dispose it.
+// Succesfully received one frame - feed it to the parser.
 ISR(USART_RX_vect) {
-  cli();
-  if (bytesReceived < USART_BUFFER_SIZE) {
-    rxBuffer[bytesReceived] = UDR0;
-    ++bytesReceived;
-
-    timer_manager_instance::callback_timer t;
-    t.timeout = 100;
-    t.id = timer_ids::usart_line_idle;
-    t.repeating = false;
-    t.callback = []() {
-      if (pmUSARTLineIdleCallback)
-        pmUSARTLineIdleCallback();
-    };
-
-    timer_manager::instance().add_milliseconds_timer(etl::move(t));
+  // Data OverRun flag must be read before UDR0
+  if (UCSR0A & _BV(DOR0))
+    ++rxStats.hardwareOverruns;
+
+  uint8_t byte = UDR0;
+  uint32_t now = timer_manager::instance().now_us();
+
+  /*
+  Parser would take the start of the next message for the missing tail of a
+  truncated one, and reject both with a bad CRC. Resynchronize on the pause.
+  */
+  if (rxParser.stage != ppsStart && now - rxLastByteUs > USART_RX_TIMEOUT_US) {
+    pmParserReset(&rxParser);
+    ++rxStats.messagesTruncated;
   }
-  sei();
+  rxLastByteUs = now;
+
+  uint8_t head = rxHead;
+  uint8_t slot = head & USART_RX_QUEUE_MASK;
+  pmParseResult result = pmParserFeed(&rxParser, byte, &rxQueue[slot]);
+
+  if (result == prUndefined || result == prIncomplete)
+    return;
+
+  /*
+  Slot next to the head must be free before publishing, as it's going to be
+  used for the next message. If it's not, the main loop is lagging behind: drop
+  this message and reuse its slot.
+  */
+  if (static_cast<uint8_t>(head + 1 - rxTail) >= USART_RX_QUEUE_SIZE) {
+    ++rxStats.messagesDropped;
+    return;
+  }
+
+  rxResults[slot] = result;
+
+  USART_MEMORY_BARRIER();
+  rxHead = head + 1;
+
+  if (pmUSARTMessageReceivedCallback)
+    pmUSARTMessageReceivedCallback();
 }
 
-// Succesfully transmitted one frame - transmit the next one if required.
-ISR(USART_TX_vect) {
-  if (bytesSent != bytesToSend) {
-    UDR0 = txBuffer[bytesSent];
-    ++bytesSent;
+// Data register is ready to take the next frame - send it, if there is one.
+ISR(USART_UDRE_vect) {
+  /*
+  Protocol messages always go first. They are queued as a whole, so log text
+  can only end up in between of them, never inside.
+  */
+  uint8_t tail = txTail;
+  if (tail != txHead) {
+    UDR0 = txQueue[tail & USART_TX_QUEUE_MASK];
+    txTail = ++tail;
+
+    uint8_t wanted = txWanted;
+    if (wanted && wanted <= txSpace(txHead, tail)) {
+      txWanted = 0;
+      if (pmUSARTSendReadyCallback)
+        pmUSARTSendReadyCallback();
+    }
+    return;
+  }
+
+  tail = logTail;
+  if (tail != logHead) {
+    UDR0 = logQueue[tail];
+    logTail = (tail + 1) & USART_LOG_QUEUE_MASK;
+    return;
   }
+
+  UCSR0B &= ~(1 << UDRIE0);
 }
 
-void pmUSARTSendDebugText(const char *message) {
-  UCSR0B &= ~((1 << RXCIE0) | (1 << TXCIE0));
+void pmUSARTSetLogLevel(pmLogLevel level) { logLevel = level; }
+
+/**
+ * Put @p size bytes of @p data to the log queue as a whole, or drop them.
+ * @return true if data has been queued.
+ */
+static bool logAppend(const char *data, uint8_t size) {
+  uint8_t head = logHead;
+  uint8_t used = (head - logTail) & USART_LOG_QUEUE_MASK;
 
-  while (*message) {
-    // Wait for USART Data Register 0 to become empty before writing anything.
-    while (!(UCSR0A & (1 << UDRE0)))
-      ;
-    UDR0 = *message;
-    ++message;
+  if (size > USART_LOG_QUEUE_SIZE - 1 - used) {
+    ++logStats.messagesDropped;
+    logStats.bytesDropped += size;
+    return false;
   }
 
-  UCSR0B |= (1 << RXCIE0) | (1 << TXCIE0);
+  for (uint8_t i = 0; i < size; ++i)
+    logQueue[(head + i) & USART_LOG_QUEUE_MASK] = data[i];
+
+  USART_MEMORY_BARRIER();
+  logHead = (head + size) & USART_LOG_QUEUE_MASK;
+
+  UCSR0B |= (1 << UDRIE0);
+
+  return true;
 }
 
-void pmUSARTSendDebugNumber(int32_t number) {
-  // int32 will have at most 12 digits, including '-' and '\0'
-  char *buffer = static_cast<char *>(malloc(12));
-  snprintf(buffer, 12, "%ld", number);
-  pmUSARTSendDebugText(buffer);
-  free(buffer);
+bool pmUSARTLogText(pmLogLevel level, const char *text) {
+  if (level < logLevel)
+    return false;
+
+  size_t size = strlen(text);
+  if (size >= USART_LOG_QUEUE_SIZE) {
+    ++logStats.messagesDropped;
+    logStats.bytesDropped += size;
+    return false;
+  }
+
+  return logAppend(text, size);
 }
+
+/**
+ * Let @p format write its output straight into the log queue. Output is kept
+ * only if it's complete, so there must be at least @p maxSize bytes of free
+ * space in the queue, or the output is dropped without even being formatted.
+ * @param maxSize longest possible output of @p format
+ * @param format callable taking a char sink and returning output length
+ * @return true if output has been queued.
+ */
+template <typename F> static bool logFormat(uint8_t maxSize, F &&format) {
+  uint8_t head = logHead;
+  uint8_t used = (head - logTail) & USART_LOG_QUEUE_MASK;
+
+  if (maxSize > USART_LOG_QUEUE_SIZE - 1 - used) {
+    ++logStats.messagesDropped;
+    logStats.bytesDropped += maxSize;
+    return false;
+  }
+
+  format([&head](char c) {
+    logQueue[head] = c;
+    head = (head + 1) & USART_LOG_QUEUE_MASK;
+  });
+
+  USART_MEMORY_BARRIER();
+  logHead = head;
+
+  UCSR0B |= (1 << UDRIE0);
+
+  return true;
+}
+
+bool pmUSARTLogNumber(pmLogLevel level, int32_t number) {
+  return pmUSARTLogFixed(level, number, 0);
+}
+
+bool pmUSARTLogFixed(pmLogLevel level, int32_t number, uint8_t fractionDigits) {
+  if (level < logLevel)
+    return false;
+
+  return logFormat(FORMAT_DECIMAL_MAX_LENGTH, [=](auto &&put) {
+    return format_decimal(number, put, fractionDigits);
+  });
+}
+
+bool pmUSARTLogHex(pmLogLevel level, uint32_t number, uint8_t digits) {
+  if (level < logLevel)
+    return false;
+
+  return logFormat(digits, [=](auto &&put) {
+    return format_hex(number, digits, put);
+  });
+}
+
+void pmUSARTLogFlush() {
+  while (logTail != logHead || txTail != txHead)
+    ;
+}
+
+void pmUSARTGetLogStats(pmUSARTLogStats *stats) { *stats = logStats; }
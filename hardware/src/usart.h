@@ -8,8 +8,40 @@
 #include "convert_util.h"
 #include "proto.h"
 
-// Set size of the output buffer, in bytes
-#define USART_BUFFER_SIZE 32
+/*
+Size of the transmit queue in bytes, must be a power of two. Serialized messages
+wait here until the data register empty interrupt shifts them out.
+*/
+#ifndef USART_TX_QUEUE_SIZE
+#define USART_TX_QUEUE_SIZE 64
+#endif
+
+/*
+Size of the log queue in bytes, must be a power of two no greater than 256.
+Log text is only sent while there are no protocol messages to send.
+*/
+#ifndef USART_LOG_QUEUE_SIZE
+#define USART_LOG_QUEUE_SIZE 256
+#endif
+
+/*
+Amount of message slots in the receive queue, must be a power of two. One slot
+is always taken by the message being received, so up to USART_RX_QUEUE_SIZE - 1
+complete messages can wait for the main loop.
+*/
+#ifndef USART_RX_QUEUE_SIZE
+#define USART_RX_QUEUE_SIZE 4
+#endif
+
+/*
+Longest pause in microseconds between two bytes of the same message. Messages
+are sent as a whole, so a longer pause means the rest of a message is lost: it
+is dropped and the parser waits for the next start marker, instead of taking the
+next message for the missing tail.
+*/
+#ifndef USART_RX_TIMEOUT_US
+#define USART_RX_TIMEOUT_US 10000
+#endif
 
 #ifdef DEAD_CODE
 class usart {
@@ -17,7 +49,7 @@ class usart {
 
   ibytevect::iterator m_output_iterator = nullptr;
   message m_output_buffer;
-  etl::circular_buffer<uint8_t, USART_BUFFER_SIZE> m_input_buffer;
+  etl::circular_buffer<uint8_t, USART_TX_QUEUE_SIZE> m_input_buffer;
 
 public:
   usart(const uint32_t &baudrate = 115200);
@@ -73,9 +105,17 @@ extern "C" {
 #endif
 
 /**
- * Serial line idle callback.
+ * Message received callback. Called from the receive interrupt as soon as a
+ * complete message (or a rejected one) is queued and can be fetched with
+ * pmUSARTPeek(). Keep it short.
  */
-extern void (*pmUSARTLineIdleCallback)(void);
+extern void (*pmUSARTMessageReceivedCallback)(void);
+
+/**
+ * Transmit queue space callback. Called from the data register empty interrupt
+ * once the space asked for with pmUSARTReserve() is free. Keep it short.
+ */
+extern void (*pmUSARTSendReadyCallback)(void);
 
 /**
  * Initialize the Universal Synchronous/Asynchronous Receiver-Transmitter #0.
@@ -85,41 +125,127 @@ extern void (*pmUSARTLineIdleCallback)(void);
 void pmUSARTInit();
 
 /**
- * Send a plant monitor message asynchroniosly.
+ * Send a plant monitor message asynchroniosly. The message is serialized into
+ * the transmit queue and sent by the interrupt right after previously queued
+ * messages, without gaps between bytes.
  * @param message message to send.
+ * @return true if the message is queued, false if there is not enough space in
+ * the transmit queue at the moment; try again later.
+ */
+bool pmUSARTSend(const plantMessage *message);
+
+/**
+ * Make sure the transmit queue has room for @p size more bytes, so that sending
+ * a message that long right after is bound to succeed. If there is no room yet,
+ * pmUSARTSendReadyCallback is called as soon as there is.
+ * @param size amount of bytes, no more than USART_TX_QUEUE_SIZE.
+ * @return true if there is enough room right now.
+ */
+bool pmUSARTReserve(uint8_t size);
+
+/// Receive queue counters, see pmUSARTGetRxStats().
+typedef struct {
+  uint16_t messagesDropped;   // complete messages dropped due to full queue
+  uint16_t hardwareOverruns;  // bytes lost before the receive interrupt ran
+  uint16_t messagesTruncated; // partial messages dropped after a pause
+} pmUSARTRxStats;
+
+/**
+ * Peek at the oldest message in the receive queue without copying it.
+ * Incoming bytes are parsed one by one as they arrive and queued by the
+ * receive interrupt, so several requests may be sent back-to-back.
+ * @param[out] message pointer to the received message. Valid only when prOk
+ * is returned, and only until pmUSARTConsume() is called.
+ * @return prOk if @p message has been received, prBadCrc or prOversized if a
+ * damaged or too long message has been received, prUndefined if the queue is
+ * empty.
  */
-void pmUSARTSend(const plantMessage *message);
+pmParseResult pmUSARTPeek(const plantMessage **message);
 
 /**
- * Copy data from the receiver buffer to heap-allocated memory.
- * @param[out] buffer pointer to heap-allocated copy of the buffer.
- * You MUST free it once you done with it. Won't be modified unless data is
- * available.
- * @return size of the @p buffer in bytes.
+ * Remove the oldest message from the receive queue, freeing its slot for the
+ * receive interrupt. Does nothing if the queue is empty.
  */
-uint8_t pmUSARTCopyReceivedData(uint8_t **buffer);
+void pmUSARTConsume();
 
 /**
- * Clear the receiver buffer.
+ * Get receive queue counters.
+ * @param[out] stats counters to write to.
  */
-void pmUSARTClearRxBuffer();
+void pmUSARTGetRxStats(pmUSARTRxStats *stats);
+
+/// Log message importance, messages below the current log level are skipped.
+typedef enum {
+  plDebug = 0,
+  plInfo,
+  plWarning,
+  plError,
+  plNone // use as a log level to disable logging
+} pmLogLevel;
+
+/// Log queue counters, see pmUSARTGetLogStats().
+typedef struct {
+  uint16_t messagesDropped; // log calls dropped due to full queue
+  uint16_t bytesDropped;    // total size of dropped log calls
+} pmUSARTLogStats;
 
 /**
- * Send null-terminated debug string over serial using blocking I/O.
- * Since this function will block until the entire message is sent, it's not
- * recommended to use this function for anything else but debugging.
- * @param message null-terminated string to send.
+ * Set the minimal level of messages to put into the log.
+ * @param level log level, plInfo by default.
  */
-void pmUSARTSendDebugText(const char *message);
+void pmUSARTSetLogLevel(pmLogLevel level);
 
 /**
- * Send decimal debug number as string of ASCII characters over serial using
- * blocking I/O. Since this function will block until the entire message is
- * sent, it's not recommended to use this function for anything else but
- * debugging.
+ * Put null-terminated string to the log. Never blocks: the text is queued and
+ * sent by the transmit interrupt in between of protocol messages. If the log
+ * queue can't fit the whole string, it is dropped and accounted for.
+ * @param level importance of the message.
+ * @param text null-terminated string to send.
+ * @return true if the text is queued.
+ */
+bool pmUSARTLogText(pmLogLevel level, const char *text);
+
+/**
+ * Put decimal number as string of ASCII characters to the log, same rules as
+ * for pmUSARTLogText() apply.
+ * @param level importance of the message.
  * @param number number to send.
+ * @return true if the number is queued.
+ */
+bool pmUSARTLogNumber(pmLogLevel level, int32_t number);
+
+/**
+ * Put fixed point decimal number to the log, i.e. @p number of 2346 with 2
+ * @p fractionDigits is logged as "23.46". Same rules as for pmUSARTLogText()
+ * apply. Formatting is done right in the log queue, without division.
+ * @param level importance of the message.
+ * @param number number to send.
+ * @param fractionDigits amount of digits after the decimal point.
+ * @return true if the number is queued.
+ */
+bool pmUSARTLogFixed(pmLogLevel level, int32_t number, uint8_t fractionDigits);
+
+/**
+ * Put hexadecimal number to the log, without any prefix. Same rules as for
+ * pmUSARTLogText() apply.
+ * @param level importance of the message.
+ * @param number number to send.
+ * @param digits amount of digits to send, leading zeros included; up to 8.
+ * @return true if the number is queued.
+ */
+bool pmUSARTLogHex(pmLogLevel level, uint32_t number, uint8_t digits);
+
+/**
+ * Wait until everything put to the log so far is sent. Blocks, so only use it
+ * when the log must not be lost, e.g. when printing benchmark results.
+ */
+void pmUSARTLogFlush();
+
+/**
+ * Get log queue counters.
+ * @param[out] stats counters to write to.
  */
-void pmUSARTSendDebugNumber(int32_t number);
+void pmUSARTGetLogStats(pmUSARTLogStats *stats);
 
 #if defined(__cplusplus)
 }